@@ -0,0 +1,1207 @@
+/** \file
+ * Translate the vectors from a PJL file into gcode for the polargraph.
+ *
+ * This is a native version of the polargraph script, which spends most
+ * of its time in the per-step interpolation.  It reads the files in a
+ * single pass, runs the same width/home length/steps per mm transform
+ * and writes the same gcode.  The debugging trace of every point, which
+ * the script always writes to /tmp/p, is only written with --points.
+ *
+ * cc -O2 -o pjl2gcode pjl2gcode.c -lm
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include "polar.h"
+#include "planner.h"
+#include "vecbin.h"
+
+/** Lookahead queue of moves, as on the board; see plan_move(). */
+#define PLAN_QUEUE 32
+#define PLAN_MERGE_MAX 16
+
+typedef struct
+{
+	int g;
+	double feed; // cartesian feed for G1, motor feed for G0
+	double cdist; // cartesian length
+	double sl1, sl2;
+	double l1, l2;
+
+	// interior points of merged moves
+	unsigned merged;
+	double ml1[PLAN_MERGE_MAX];
+	double ml2[PLAN_MERGE_MAX];
+} plan_move_t;
+
+typedef struct
+{
+	polar_t polar;
+	double feed;
+	double transit_feed;
+	double acceleration;
+	double step_size;
+	double max_error;
+	double pause_seconds;
+	double offset_x;
+	double offset_y;
+	double scale;
+	int motor_on;
+	int send_home;
+	int rotate;
+
+	FILE * out;
+	FILE * points;
+
+	// compact encoding, see compact_emit()
+	int compact;
+	int precision;
+	double feed_tolerance;
+	int last_g;
+	long long last_f;
+	long long q1, q2;
+
+	int plan;
+	double merge;
+	planner_t planner;
+	plan_move_t queue[PLAN_QUEUE];
+	unsigned queue_head;
+	unsigned queue_count;
+	double plan_l1, plan_l2; // end of the last move
+	double plan_v; // speed at the end of the last planned move
+	double plan_u[2]; // and its direction
+	double plan_draw_time;
+	double plan_transit_time;
+	double marker_time;
+	unsigned markers;
+	double pause_time;
+
+	// last position in motor space, for the speed of each step
+	double ol1;
+	double ol2;
+
+	double total_dist;
+	double total_time;
+	double transit_dist;
+	double transit_time;
+} plot_t;
+
+
+static double
+len(
+	const double x1,
+	const double y1,
+	const double x2,
+	const double y2
+)
+{
+	const double dx = x2 - x1;
+	const double dy = y2 - y1;
+	return sqrt(dx*dx + dy*dy);
+}
+
+
+/** Motor lengths for x,y and the distance moved in motor space
+ * since the last call.
+ */
+static double
+compute_lengths(
+	plot_t * const p,
+	const double x,
+	const double y,
+	double * const l1,
+	double * const l2
+)
+{
+	polar_lengths(&p->polar, x, y, l1, l2);
+
+	const double dl1 = *l1 - p->ol1;
+	const double dl2 = *l2 - p->ol2;
+	p->ol1 = *l1;
+	p->ol2 = *l2;
+
+	return sqrt(dl1*dl1 + dl2*dl2);
+}
+
+
+/** Compact encoding.
+ *
+ * The serial link is the limit on dense curves, so with --compact the
+ * moves are sent in relative mode (G91) with the words that have not
+ * changed left out: the motion mode, the feed if it is within
+ * feed_tolerance of the last one sent, and an axis that does not move.
+ * The deltas are rounded to precision decimals from the rounded
+ * position that has already been sent, so the rounding never adds up,
+ * and are written without spaces or trailing zeros.
+ */
+static void
+compact_coord(
+	plot_t * const p,
+	const char axis,
+	const long long delta
+)
+{
+	if (delta == 0)
+		return;
+
+	long long scale = 1;
+	for (int i = 0 ; i < p->precision ; i++)
+		scale *= 10;
+
+	const unsigned long long mag = delta < 0 ? -delta : delta;
+	unsigned long long frac = mag % scale;
+	int digits = p->precision;
+
+	fputc(axis, p->out);
+	if (delta < 0)
+		fputc('-', p->out);
+	if (mag / scale)
+		fprintf(p->out, "%llu", mag / scale);
+
+	if (!frac)
+		return;
+
+	while (frac % 10 == 0)
+	{
+		frac /= 10;
+		digits--;
+	}
+
+	fprintf(p->out, ".%0*llu", digits, frac);
+}
+
+
+static void
+compact_emit(
+	plot_t * const p,
+	const int g,
+	const double l1,
+	const double l2,
+	const long long feed
+)
+{
+	double scale = 1;
+	for (int i = 0 ; i < p->precision ; i++)
+		scale *= 10;
+
+	const long long q1 = llround(l1 * scale);
+	const long long q2 = llround(l2 * scale);
+	if (q1 == p->q1 && q2 == p->q2)
+		return;
+
+	if (g != p->last_g)
+		fprintf(p->out, "G%d", g);
+	compact_coord(p, 'X', q1 - p->q1);
+	compact_coord(p, 'Y', q2 - p->q2);
+
+	if (g != p->last_g
+	||  fabs((double)(feed - p->last_f)) > p->last_f * p->feed_tolerance / 100)
+	{
+		fprintf(p->out, "F%lld", feed);
+		p->last_f = feed;
+	}
+
+	fputc('\n', p->out);
+	p->last_g = g;
+	p->q1 = q1;
+	p->q2 = q2;
+}
+
+
+static void
+plan_emit(
+	plot_t * const p,
+	const plan_move_t * const m
+)
+{
+	if (m->g == 0)
+	{
+		if (p->compact)
+			compact_emit(p, 0, m->l1, m->l2, (long long) m->feed);
+		else
+			fprintf(p->out, "G0 X%.3f Y%.3f F%lld\n", m->l1, m->l2, (long long) m->feed);
+		return;
+	}
+
+	const double dl1 = m->l1 - m->sl1;
+	const double dl2 = m->l2 - m->sl2;
+	const double ldist = sqrt(dl1*dl1 + dl2*dl2);
+
+	// how fast we have to move that distance to equal
+	// moving the cartesian distance at the feed rate
+	const double lfeed = m->cdist != 0
+		? m->feed * ldist / m->cdist
+		: m->feed;
+
+	if (p->compact)
+		compact_emit(p, 1, m->l1, m->l2, (long long) lfeed);
+	else
+		fprintf(p->out, "G1 X%.3f Y%.3f F%lld\n", m->l1, m->l2, (long long) lfeed);
+}
+
+
+/** Motor space length, direction and nominal speed in mm/s. */
+static double
+plan_vector(
+	const planner_t * const pl,
+	const plan_move_t * const m,
+	double * const u,
+	double * const nominal
+)
+{
+	const double dl1 = m->l1 - m->sl1;
+	const double dl2 = m->l2 - m->sl2;
+	const double ldist = sqrt(dl1*dl1 + dl2*dl2);
+
+	if (ldist > 0)
+	{
+		u[0] = dl1 / ldist;
+		u[1] = dl2 / ldist;
+	}
+
+	const double feed = m->g == 0 || m->cdist == 0
+		? m->feed
+		: m->feed * ldist / m->cdist;
+	*nominal = planner_nominal(pl, u, feed / 60.0);
+
+	return ldist;
+}
+
+
+/** Plan and send the oldest move in the queue.
+ *
+ * Like the firmware, the entry speeds are worked out backwards from a
+ * stop after the last queued move, limited by the junction speeds and
+ * how quickly each move can slow down, and then the oldest move is
+ * run forwards from the speed the previous one ended at.
+ */
+static void
+plan_pop(
+	plot_t * const p
+)
+{
+	const planner_t * const pl = &p->planner;
+	double exit_v = 0;
+
+	for (unsigned k = p->queue_count ; k-- > 1 ; )
+	{
+		const plan_move_t * const m = &p->queue[(p->queue_head + k) % PLAN_QUEUE];
+		const plan_move_t * const prev = &p->queue[(p->queue_head + k - 1) % PLAN_QUEUE];
+
+		double u[2] = { 0, 0 }, nominal;
+		const double ldist = plan_vector(pl, m, u, &nominal);
+		if (ldist <= 0)
+			continue;
+
+		double up[2] = { u[0], u[1] }, nominal_prev;
+		plan_vector(pl, prev, up, &nominal_prev);
+
+		double entry = planner_max_entry(pl, ldist, exit_v);
+		const double junction = planner_junction_speed(pl, up, u,
+			nominal < nominal_prev ? nominal : nominal_prev);
+		if (entry > junction)
+			entry = junction;
+
+		exit_v = entry;
+	}
+
+	const plan_move_t * const m = &p->queue[p->queue_head];
+	double u[2] = { p->plan_u[0], p->plan_u[1] }, nominal;
+	const double ldist = plan_vector(pl, m, u, &nominal);
+
+	if (ldist > 0)
+	{
+		double entry = p->plan_v;
+		const double junction = planner_junction_speed(pl, p->plan_u, u, nominal);
+		if (entry > junction)
+			entry = junction;
+
+		// the exit can not be faster than it can accelerate to
+		double exit = planner_max_entry(pl, ldist, entry);
+		if (exit > exit_v)
+			exit = exit_v;
+		if (exit > nominal)
+			exit = nominal;
+
+		const double t = planner_trapezoid_time(pl, ldist, entry, nominal, exit);
+		if (m->g == 0)
+			p->plan_transit_time += t;
+		else
+			p->plan_draw_time += t;
+		p->plan_v = exit;
+		p->plan_u[0] = u[0];
+		p->plan_u[1] = u[1];
+	}
+
+	plan_emit(p, m);
+	p->queue_head = (p->queue_head + 1) % PLAN_QUEUE;
+	p->queue_count--;
+}
+
+
+/** Send everything in the queue, which then comes to a stop. */
+static void
+plan_flush(
+	plot_t * const p
+)
+{
+	while (p->queue_count)
+		plan_pop(p);
+	p->plan_v = 0;
+}
+
+
+/** Distance in motor space of the point l1,l2 from the line through
+ * the start and end of m.
+ */
+static double
+plan_deviation(
+	const plan_move_t * const m,
+	const double l1,
+	const double l2
+)
+{
+	const double dl1 = m->l1 - m->sl1;
+	const double dl2 = m->l2 - m->sl2;
+	const double ldist = sqrt(dl1*dl1 + dl2*dl2);
+
+	return fabs((l1 - m->sl1) * dl2 - (l2 - m->sl2) * dl1) / ldist;
+}
+
+
+/** Try to extend the newest queued draw move to end at l1,l2
+ * instead, if that keeps all of its points within the merge
+ * tolerance of the new line.
+ */
+static int
+plan_merge(
+	plot_t * const p,
+	const double l1,
+	const double l2,
+	const double cdist,
+	const double feed
+)
+{
+	if (!p->queue_count)
+		return 0;
+
+	plan_move_t * const last = &p->queue[(p->queue_head + p->queue_count - 1) % PLAN_QUEUE];
+	if (last->g != 1 || last->feed != feed || last->merged == PLAN_MERGE_MAX)
+		return 0;
+
+	plan_move_t m = *last;
+	m.l1 = l1;
+	m.l2 = l2;
+	if (m.l1 == m.sl1 && m.l2 == m.sl2)
+		return 0;
+
+	if (plan_deviation(&m, last->l1, last->l2) > p->merge)
+		return 0;
+
+	for (unsigned i = 0 ; i < last->merged ; i++)
+		if (plan_deviation(&m, last->ml1[i], last->ml2[i]) > p->merge)
+			return 0;
+
+	// the pen must still be moving forwards along the line
+	const double dot = (last->l1 - last->sl1) * (l1 - last->l1)
+		+ (last->l2 - last->sl2) * (l2 - last->l2);
+	if (dot <= 0)
+		return 0;
+
+	m.ml1[m.merged] = last->l1;
+	m.ml2[m.merged] = last->l2;
+	m.merged++;
+	m.cdist += cdist;
+	*last = m;
+
+	return 1;
+}
+
+
+/** Send a move to motor position l1,l2, which is cdist away in
+ * cartesian space.  Every move goes through the lookahead queue so
+ * that the plot time can be estimated, and with --plan nearly
+ * collinear draw moves are merged there into one.
+ */
+static void
+plan_move(
+	plot_t * const p,
+	const int g,
+	const double l1,
+	const double l2,
+	const double cdist,
+	const double feed
+)
+{
+	const plan_move_t m = {
+		.g = g,
+		.feed = feed,
+		.cdist = cdist,
+		.sl1 = p->queue_count ? p->queue[(p->queue_head + p->queue_count - 1) % PLAN_QUEUE].l1 : p->plan_l1,
+		.sl2 = p->queue_count ? p->queue[(p->queue_head + p->queue_count - 1) % PLAN_QUEUE].l2 : p->plan_l2,
+		.l1 = l1,
+		.l2 = l2,
+	};
+
+	p->plan_l1 = l1;
+	p->plan_l2 = l2;
+
+	if (p->plan && g == 1 && plan_merge(p, l1, l2, cdist, feed))
+		return;
+
+	if (p->queue_count == PLAN_QUEUE)
+		plan_pop(p);
+
+	p->queue[(p->queue_head + p->queue_count++) % PLAN_QUEUE] = m;
+}
+
+
+/** Move the pen somewhere, quickly. */
+static void
+goxy(
+	plot_t * const p,
+	const double x,
+	const double y,
+	const double feed
+)
+{
+	double l1, l2;
+	compute_lengths(p, x, y, &l1, &l2);
+
+	if (p->points)
+		fprintf(p->points, "%.3f %.3f -> %.3f %.3f @ %.3f\n",
+			x, y, l1, l2, feed);
+
+	plan_move(p, 0, l1, l2, 0, feed);
+}
+
+
+/** Draw to x,y, which is step_dist away in cartesian space, with the
+ * motor feed scaled so that the pen moves at a constant speed.
+ */
+static void
+goxy_feed(
+	plot_t * const p,
+	const double x,
+	const double y,
+	const double step_dist,
+	const double feed
+)
+{
+	double l1, l2;
+	const double ldist = compute_lengths(p, x, y, &l1, &l2);
+
+	// how fast we have to move that distance to equal
+	// moving step_dist at the feed rate
+	const double lfeed = step_dist != 0
+		? feed * ldist / step_dist
+		: feed;
+
+	if (p->points)
+		fprintf(p->points, "%.3f %.3f -> %.3f %.3f @ %.3f %.3f\n",
+			x, y, l1, l2, lfeed, step_dist);
+
+	plan_move(p, 1, l1, l2, step_dist, feed);
+}
+
+
+/** Draw a straight line by interpolating it at step_size in
+ * cartesian space.
+ */
+static void
+goxy_step(
+	plot_t * const p,
+	double x0,
+	double y0,
+	const double x1,
+	const double y1,
+	const double feed
+)
+{
+	const double dx = x1 - x0;
+	const double dy = y1 - y0;
+	const double dist = sqrt(dx*dx + dy*dy);
+
+	const long steps = (long)(dist / p->step_size) + 1;
+	const double step_dist = dist / steps;
+
+	for (long i = 0 ; i < steps ; i++)
+	{
+		x0 += dx / steps;
+		y0 += dy / steps;
+		goxy_feed(p, x0, y0, step_dist, feed);
+	}
+}
+
+
+/** Adaptive interpolation.
+ *
+ * Between two G1 points the motors move linearly in string length, so
+ * the pen follows a curve rather than the straight cartesian line.
+ * Where the mapping is nearly linear, around the middle of the wall,
+ * long steps stay on the line, while near the top corners even short
+ * ones bow away from it.  Each piece of the line is split in half until
+ * the pen position halfway through the motor move is within max_error
+ * of the line, so points are only added where they are needed.
+ */
+#define PLOT_SPLIT_DEPTH 16
+
+static void
+goxy_split(
+	plot_t * const p,
+	const double ax,
+	const double ay,
+	const double bx,
+	const double by,
+	const double ux,
+	const double uy,
+	const double feed,
+	const int depth
+)
+{
+	double al1, al2, bl1, bl2, mx, my;
+	polar_lengths(&p->polar, ax, ay, &al1, &al2);
+	polar_lengths(&p->polar, bx, by, &bl1, &bl2);
+	polar_position(&p->polar, (al1 + bl1) / 2, (al2 + bl2) / 2, &mx, &my);
+
+	// distance of the motor space midpoint from the line along u
+	const double error = fabs((mx - ax) * uy - (my - ay) * ux);
+
+	// pieces shorter than the tolerance are never split, which also
+	// ends the search for points off the wall where there is no fit
+	const double dist = len(ax, ay, bx, by);
+
+	if (error > p->max_error
+	&&  dist > p->max_error
+	&&  depth < PLOT_SPLIT_DEPTH)
+	{
+		const double cx = (ax + bx) / 2;
+		const double cy = (ay + by) / 2;
+		goxy_split(p, ax, ay, cx, cy, ux, uy, feed, depth + 1);
+		goxy_split(p, cx, cy, bx, by, ux, uy, feed, depth + 1);
+		return;
+	}
+
+	goxy_feed(p, bx, by, dist, feed);
+}
+
+
+static void
+goxy_adaptive(
+	plot_t * const p,
+	const double x0,
+	const double y0,
+	const double x1,
+	const double y1,
+	const double feed
+)
+{
+	const double dist = len(x0, y0, x1, y1);
+	if (dist == 0)
+	{
+		goxy_feed(p, x1, y1, 0, feed);
+		return;
+	}
+
+	goxy_split(p, x0, y0, x1, y1,
+		(x1 - x0) / dist, (y1 - y0) / dist, feed, 0);
+}
+
+
+/** Match "P r g b", returning a pointer to each number. */
+static int
+parse_layer(
+	char * line,
+	char ** const rgb
+)
+{
+	line++;
+	for (int i = 0 ; i < 3 ; i++)
+	{
+		const char * const start = line;
+		while (isspace((unsigned char) *line))
+			line++;
+		if (i > 0 && line == start)
+			return 0;
+
+		rgb[i] = line;
+		while (isdigit((unsigned char) *line))
+			line++;
+		if (line == rgb[i])
+			return 0;
+	}
+
+	return *line == '\0';
+}
+
+
+static char *
+parse_number(
+	char * line,
+	double * const v,
+	const int need_space
+)
+{
+	char * const start = line;
+	while (isspace((unsigned char) *line))
+		line++;
+	if (need_space && line == start)
+		return NULL;
+
+	char * const num = line;
+	while (*line == '-' || *line == '+' || *line == '.' || isdigit((unsigned char) *line))
+		line++;
+	if (line == num)
+		return NULL;
+
+	*v = strtod(num, NULL);
+	return line;
+}
+
+
+/** Pause between the layers. */
+static void
+plot_layer(
+	plot_t * const p
+)
+{
+	plan_flush(p);
+	p->pause_time += p->pause_seconds;
+	fprintf(p->out, "G4 S%.2f\n", p->pause_seconds);
+}
+
+
+/** Move (M) or draw (L) to x,y in the drawing. */
+static void
+plot_point(
+	plot_t * const p,
+	const char cmd,
+	double x,
+	double y,
+	double * const old
+)
+{
+	// swap the axis if we are rotating the image
+	if (p->rotate)
+	{
+		const double t = x;
+		x = p->polar.width - y;
+		y = t;
+	}
+
+	x = x * p->scale + p->offset_x;
+	y = y * p->scale + p->offset_y;
+
+	// if the x and y are outside of our bounding box,
+	// warn that this might not work
+	if (x < 0 || x > p->polar.width || y < 0 || y > p->polar.height)
+		fprintf(stderr, "!!! %.02f,%.02f out of bounds\n", x, y);
+
+	const double dist = len(old[0], old[1], x, y);
+
+	if (cmd == 'M')
+	{
+		goxy(p, x, y, p->transit_feed);
+		p->transit_dist += dist;
+		p->transit_time += dist / (p->transit_feed / 60.0);
+	} else {
+		if (p->max_error > 0)
+			goxy_adaptive(p, old[0], old[1], x, y, p->feed);
+		else
+			goxy_step(p, old[0], old[1], x, y, p->feed);
+		p->total_dist += dist;
+		p->total_time += dist / (p->feed / 60.0);
+	}
+
+	old[0] = x;
+	old[1] = y;
+}
+
+
+static void
+plot_line(
+	plot_t * const p,
+	char * const line,
+	double * const old
+)
+{
+	// ignore anything other than pen up/down commands
+	const char cmd = line[0];
+	if (cmd != 'M' && cmd != 'P' && cmd != 'L' && cmd != 'Z')
+		return;
+
+	// a "P" by itself is a layer change or end of file
+	char * rgb[3];
+	if (cmd == 'P' && parse_layer(line, rgb))
+	{
+		fprintf(stderr, "layer %.*s %.*s %.*s\n",
+			(int) strspn(rgb[0], "0123456789"), rgb[0],
+			(int) strspn(rgb[1], "0123456789"), rgb[1],
+			(int) strspn(rgb[2], "0123456789"), rgb[2]
+		);
+		plot_layer(p);
+		return;
+	}
+
+	if (cmd != 'M' && cmd != 'L')
+		return;
+
+	double x, y;
+	char * s = line + 1;
+	if (!(s = parse_number(s, &x, 0))
+	||  !(s = parse_number(s, &y, 1))
+	||  *s != '\0')
+		return;
+
+	plot_point(p, cmd, x, y, old);
+}
+
+
+/** Plot a file in the binary vector format, see vecbin.h, whose first
+ * len bytes have already been read into head.  The points are the same
+ * as the text would give, so the gcode is too.
+ */
+static int
+plot_binary(
+	plot_t * const p,
+	FILE * const f,
+	const void * const head,
+	const size_t len,
+	double * const old
+)
+{
+	vecbin_t vb;
+	if (vecbin_open(&vb, f, head, len) < 0)
+		return -1;
+
+	const double unit = VECBIN_UNITS;
+	vecbin_block_t blk;
+	const uint32_t * lens;
+	const int32_t * xy;
+	int rc;
+
+	while ((rc = vecbin_next(&vb, &blk, &lens, &xy)) > 0)
+	{
+		if (blk.flags & VECBIN_LAYER)
+		{
+			fprintf(stderr, "layer %d %d %d\n",
+				blk.color[0], blk.color[1], blk.color[2]);
+			plot_layer(p);
+		}
+
+		for (uint32_t i = 0 ; i < blk.paths ; i++)
+		{
+			char cmd = (i == 0 && (blk.flags & VECBIN_CONTINUE)) ? 'L' : 'M';
+			for (uint32_t j = 0 ; j < lens[i] ; j++, xy += 2)
+			{
+				plot_point(p, cmd, xy[0] / unit, xy[1] / unit, old);
+				cmd = 'L';
+			}
+		}
+	}
+
+	vecbin_close(&vb);
+	return rc;
+}
+
+
+static void
+print_time(
+	const char * const name,
+	const double dist,
+	const double time
+)
+{
+	fprintf(stderr, "%s%8.02fm %7.0f:%02.0f\n",
+		name,
+		dist / 1000.0,
+		time / 60,
+		(double)((long long) time % 60)
+	);
+}
+
+
+static void
+print_estimate(
+	const char * const name,
+	const double time
+)
+{
+	const long long t = (long long)(time + 0.5);
+	fprintf(stderr, "%s%4lld:%02lld:%02lld\n",
+		name,
+		t / 3600,
+		t / 60 % 60,
+		t % 60
+	);
+}
+
+
+static const char usage[] =
+"Usage: pjl2gcode [options] [file.pjl...] > file.gcode\n"
+"Plot a set of vectors on the polargraph.\n"
+"Options:\n"
+"    -H | --home       Send the set-home command in the gcode\n"
+"    -w | --width N    Separation between the pulleys in mm\n"
+"    -l | --length N   Length of the two strings at the home position in mm\n"
+"    -f | --feed N     Feed rate for the motors in mm/sec\n"
+"    -F | --transit N  Transit rate for the motors in mm/sec\n"
+"    -n | --step N     Interpolation step size for straight lines in mm\n"
+"    --max-error N     Instead of fixed steps, split lines only where the\n"
+"                      pen would stray more than N mm from them\n"
+"    -a | --accel      Acceleration in mm/s/s (override config)\n"
+"    -M | --motors-on  Leave the motors on after the plot (default off)\n"
+"    -r | --rotate     Rotate the PDF 90 degrees\n"
+"    -p | --pause      Seconds to pause between layers\n"
+"    --offset x,y      Shift the origin to x,y in mm\n"
+"    --scale N         Scale the plot by this factor\n"
+"    --steps N         Adjust the steps/mm to deal with maljusted printers\n"
+"    --points FILE     Write a trace of every point to FILE\n"
+"    -c | --compact    Fewer bytes per move: relative moves, no repeated words\n"
+"    --precision N     Decimals for --compact (default 2)\n"
+"    --feed-tolerance N  Percent change before --compact resends F (default 1)\n"
+"    --plan            Merge nearly collinear moves in the lookahead queue\n"
+"    --merge N         Tolerance in mm for merging moves (default 0.01)\n"
+"    --junction-deviation N  As in the config (default 0.01)\n"
+"    --max-rate N      Motor speed limit in mm/min, as alpha_max_rate\n"
+"    --marker-time N   Seconds to allow for each marker change\n"
+"    --markers a,b,..  The marker for each file; files that share one are\n"
+"                      plotted together with no change between them\n"
+;
+
+
+int main(int argc, char ** argv)
+{
+	plot_t p = {
+		.polar = {
+			.width = 2501.9,
+			.home_length = 2032.0,
+			.steps_per_mm = 1,
+		},
+		.feed = 2000,
+		.transit_feed = 2500,
+		.step_size = 10,
+		.pause_seconds = 1,
+		.scale = 1,
+		.out = stdout,
+		.merge = 0.01,
+		.precision = 2,
+		.feed_tolerance = 1,
+		.planner = {
+			.acceleration = 1000,
+			.junction_deviation = 0.01,
+			.max_rate = { 30000 / 60.0, 30000 / 60.0 },
+		},
+	};
+
+	const char * points_file = NULL;
+	char * markers_list = NULL;
+
+	static const struct option long_options[] = {
+		{ "home",	no_argument,		NULL, 'H' },
+		{ "rotate",	no_argument,		NULL, 'r' },
+		{ "width",	required_argument,	NULL, 'w' },
+		{ "length",	required_argument,	NULL, 'l' },
+		{ "feed",	required_argument,	NULL, 'f' },
+		{ "transit",	required_argument,	NULL, 'F' },
+		{ "accel",	required_argument,	NULL, 'a' },
+		{ "step",	required_argument,	NULL, 'n' },
+		{ "max-error",	required_argument,	NULL, 'e' },
+		{ "pause",	required_argument,	NULL, 'p' },
+		{ "motors-on",	no_argument,		NULL, 'M' },
+		{ "offset-x",	required_argument,	NULL, 'x' },
+		{ "offset-y",	required_argument,	NULL, 'y' },
+		{ "offset",	required_argument,	NULL, 'o' },
+		{ "scale",	required_argument,	NULL, 's' },
+		{ "steps",	required_argument,	NULL, 'S' },
+		{ "points",	required_argument,	NULL, 'P' },
+		{ "compact",	no_argument,		NULL, 'c' },
+		{ "precision",	required_argument,	NULL, 'd' },
+		{ "feed-tolerance", required_argument,	NULL, 't' },
+		{ "plan",	no_argument,		NULL, 'L' },
+		{ "merge",	required_argument,	NULL, 'm' },
+		{ "junction-deviation", required_argument, NULL, 'j' },
+		{ "max-rate",	required_argument,	NULL, 'R' },
+		{ "marker-time", required_argument,	NULL, 'T' },
+		{ "markers",	required_argument,	NULL, 'K' },
+		{ "help",	no_argument,		NULL, 'h' },
+		{ NULL, 0, NULL, 0 },
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "Hrw:l:f:F:a:n:p:Mx:y:ch?", long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+		case 'H': p.send_home++; break;
+		case 'r': p.rotate++; break;
+		case 'w': p.polar.width = atof(optarg); break;
+		case 'l': p.polar.home_length = atof(optarg); break;
+		case 'f': p.feed = atof(optarg); break;
+		case 'F': p.transit_feed = atof(optarg); break;
+		case 'a': p.acceleration = atof(optarg); break;
+		case 'n': p.step_size = atof(optarg); break;
+		case 'e': p.max_error = atof(optarg); break;
+		case 'p': p.pause_seconds = atof(optarg); break;
+		case 'M': p.motor_on = 1; break;
+		case 'x': p.offset_x = atof(optarg); break;
+		case 'y': p.offset_y = atof(optarg); break;
+		case 'o':
+			if (sscanf(optarg, "%lf,%lf", &p.offset_x, &p.offset_y) != 2)
+			{
+				fprintf(stderr, "%s", usage);
+				return -1;
+			}
+			break;
+		case 's': p.scale = atof(optarg); break;
+		case 'S': p.polar.steps_per_mm = atof(optarg); break;
+		case 'P': points_file = optarg; break;
+		case 'c': p.compact = 1; break;
+		case 'd': p.precision = atoi(optarg); break;
+		case 't': p.feed_tolerance = atof(optarg); break;
+		case 'L': p.plan = 1; break;
+		case 'm': p.merge = atof(optarg); break;
+		case 'j': p.planner.junction_deviation = atof(optarg); break;
+		case 'R':
+			p.planner.max_rate[0] = atof(optarg) / 60.0;
+			p.planner.max_rate[1] = p.planner.max_rate[0];
+			break;
+		case 'T': p.marker_time = atof(optarg); break;
+		case 'K': markers_list = optarg; break;
+		case 'h': printf("%s", usage); return 0;
+		default: fprintf(stderr, "%s", usage); return -1;
+		}
+	}
+
+	if (p.acceleration)
+		p.planner.acceleration = p.acceleration;
+
+	if (p.step_size <= 0 || p.max_error < 0 || p.feed <= 0 || p.transit_feed <= 0
+	||  p.precision < 0 || p.precision > 6 || p.feed_tolerance < 0
+	||  p.merge < 0 || p.planner.acceleration <= 0 || p.planner.junction_deviation < 0)
+	{
+		fprintf(stderr, "%s", usage);
+		return -1;
+	}
+
+	const int nfiles = optind < argc ? argc - optind : 1;
+	const char ** const names = calloc(nfiles, sizeof(*names));
+	const char ** const file_markers = calloc(nfiles, sizeof(*file_markers));
+	if (!names || !file_markers)
+	{
+		perror("markers");
+		return -1;
+	}
+
+	for (int i = 0 ; i < nfiles ; i++)
+	{
+		names[i] = optind < argc ? argv[optind + i] : "-";
+		file_markers[i] = names[i];
+	}
+
+	// with --markers the files are grouped by marker, in the order
+	// that each marker is first used, and only a new marker is a change
+	if (markers_list)
+	{
+		int count = 0;
+		for (char * m ; (m = strsep(&markers_list, ",")) ; count++)
+			if (count < nfiles)
+				file_markers[count] = m;
+
+		if (count != nfiles)
+		{
+			fprintf(stderr, "--markers has %d names for %d files\n",
+				count, nfiles);
+			return -1;
+		}
+
+		for (int i = 1 ; i < nfiles ; i++)
+		{
+			int j = i;
+			while (j > 0 && strcmp(file_markers[j - 1], file_markers[i]) != 0)
+				j--;
+			if (j == 0 || j == i)
+				continue;
+
+			// move file i up to just after the last one with its marker
+			const char * const name = names[i];
+			const char * const marker = file_markers[i];
+			memmove(&names[j + 1], &names[j], (i - j) * sizeof(*names));
+			memmove(&file_markers[j + 1], &file_markers[j], (i - j) * sizeof(*file_markers));
+			names[j] = name;
+			file_markers[j] = marker;
+		}
+	}
+
+	if (polar_init(&p.polar) < 0)
+	{
+		fprintf(stderr, "Width %g is too wide for length %g!\n",
+			p.polar.width, p.polar.home_length);
+		return -1;
+	}
+
+	const double width = p.polar.width;
+	const double height = p.polar.height;
+	fprintf(stderr, "Computed height: %0.2fmm\n", height);
+	fprintf(stderr, "0 0\n");
+	fprintf(stderr, "%.2f %.2f\n", width, 0.0);
+	fprintf(stderr, "%.2f %.2f\n", width, height);
+	fprintf(stderr, "%.2f %.2f\n", 0.0, height);
+	fprintf(stderr, "0 0\n\n");
+
+	if (points_file && !(p.points = fopen(points_file, "w")))
+	{
+		perror(points_file);
+		return -1;
+	}
+
+	static char out_buf[1 << 16];
+	setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
+
+	fprintf(p.out, "M999\n"); // reset any error condition
+	if (p.acceleration)
+		fprintf(p.out, "M204 S%.0f\n", p.acceleration);
+
+	fprintf(p.out, "G90\nG92 X0 Y0\n");
+	if (p.send_home)
+		fprintf(p.out, "G92 X%.15g Y%.15g\n",
+			p.polar.home_length, p.polar.home_length);
+
+	if (p.compact)
+	{
+		// relative moves start from wherever G92 put the motors
+		const double home = p.send_home ? p.polar.home_length : 0;
+		double scale = 1;
+		for (int i = 0 ; i < p.precision ; i++)
+			scale *= 10;
+		p.q1 = p.q2 = llround(home * scale);
+		p.last_g = -1;
+		fprintf(p.out, "G91\n");
+	}
+
+	// a marker change is sent whenever the input moves on to a new
+	// file; like the script, a plot from stdin starts with one
+	const char * old_marker = optind < argc ? file_markers[0] : "stdin";
+	double old[2] = { 0, 0 };
+	char * line = NULL;
+	size_t line_size = 0;
+
+	for (int i = 0 ; i < nfiles ; i++)
+	{
+		const char * const name = names[i];
+		FILE * const f = strcmp(name, "-") == 0 ? stdin : fopen(name, "r");
+		if (!f)
+		{
+			fprintf(stderr, "Can't open %s: ", name);
+			perror(NULL);
+			continue;
+		}
+
+		// binary files are told apart by their magic; a text line
+		// that starts like it is not plotted, so if it is not the
+		// magic after all, the rest of the line is skipped
+		char head[4];
+		size_t head_len = 0;
+		int c;
+		while (head_len < sizeof(head)
+		&&     (c = getc(f)) == VECBIN_MAGIC[head_len])
+			head[head_len++] = c;
+
+		if (head_len < sizeof(head))
+		{
+			if (head_len)
+				while (c != '\n' && c != EOF)
+					c = getc(f);
+			else
+			if (c != EOF)
+				ungetc(c, f);
+			head_len = 0;
+		}
+
+		if (head_len && strcmp(file_markers[i], old_marker) != 0)
+		{
+			old_marker = file_markers[i];
+			plan_flush(&p);
+			p.markers++;
+			fprintf(p.out, "M72 P2\n");
+			fprintf(p.out, "M71 (Marker Change)\n");
+		}
+
+		if (head_len)
+		{
+			if (plot_binary(&p, f, head, head_len, old) < 0)
+				fprintf(stderr, "%s: bad binary vectors\n", name);
+			if (f != stdin)
+				fclose(f);
+			continue;
+		}
+
+		int first = 1;
+		ssize_t n;
+		while ((n = getline(&line, &line_size, f)) >= 0)
+		{
+			if (first && strcmp(file_markers[i], old_marker) != 0)
+			{
+				old_marker = file_markers[i];
+				plan_flush(&p);
+				p.markers++;
+				fprintf(p.out, "M72 P2\n");
+				fprintf(p.out, "M71 (Marker Change)\n");
+			}
+			first = 0;
+
+			if (n > 0 && line[n-1] == '\n')
+				line[n-1] = '\0';
+
+			plot_line(&p, line, old);
+		}
+
+		if (f != stdin)
+			fclose(f);
+	}
+
+	free(line);
+	free(names);
+	free(file_markers);
+
+	plan_flush(&p);
+	p.plan_transit_time += planner_move_time(&p.planner,
+		p.plan_l1, p.plan_l2, p.transit_feed / 60.0);
+
+	if (p.compact)
+		fprintf(p.out, "G90\n");
+
+	// Send the marker back to home at the high speed
+	fprintf(p.out, "G1 X%.3f Y%.3f F%lld\n", 0.0, 0.0, (long long) p.transit_feed);
+
+	// Turn off the motors if requested
+	if (!p.motor_on)
+		fprintf(p.out, "M18 X Y\n");
+	fprintf(p.out, "M72 P1\n");
+	fprintf(p.out, "M137\n");
+	fflush(p.out);
+
+	if (p.points)
+		fclose(p.points);
+
+	// Report some stats
+	print_time("Drawing ", p.total_dist, p.total_time);
+	print_time("Transit ", p.transit_dist, p.transit_time);
+	print_time("Total   ",
+		p.total_dist + p.transit_dist,
+		p.total_time + p.transit_time);
+
+	// and what the planner expects it to take
+	const double markers = p.markers * p.marker_time;
+	print_estimate("Estimate drawing ", p.plan_draw_time);
+	print_estimate("Estimate transit ", p.plan_transit_time);
+	print_estimate("Estimate pauses  ", p.pause_time + markers);
+	fprintf(stderr, "Marker changes   %u\n", p.markers);
+	print_estimate("Estimate total   ",
+		p.plan_draw_time + p.plan_transit_time + p.pause_time + markers);
+
+	return 0;
+}
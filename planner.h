@@ -0,0 +1,139 @@
+/** \file
+ * Lookahead motion planning, modelled on the Smoothieboard planner.
+ *
+ * Moves are straight lines in motor space, each with a nominal speed.
+ * The speed through the junction between two moves is limited by the
+ * junction deviation: the pen is allowed to cut the corner along an
+ * arc that stays within junction_deviation mm of it, at the speed
+ * which gives the configured centripetal acceleration.  Speeds then
+ * ramp up and down between the junctions at the configured
+ * acceleration, and the queue is assumed to come to a stop after its
+ * last move, just as the firmware plans for.
+ *
+ * Each motor also has a maximum rate, like alpha_max_rate and
+ * beta_max_rate, and a move whose nominal speed would drive either
+ * motor faster than its limit is slowed down as a whole.
+ */
+#ifndef _planner_h_
+#define _planner_h_
+
+#include <math.h>
+
+typedef struct
+{
+	double acceleration; // mm/s^2
+	double junction_deviation; // mm
+	double max_rate[2]; // mm/s for each motor, or 0 for no limit
+} planner_t;
+
+
+/** Nominal speed of a move along the unit vector u at speed v,
+ * slowed down if needed so that neither motor exceeds its rate.
+ */
+static inline double
+planner_nominal(
+	const planner_t * const pl,
+	const double * const u,
+	double v
+)
+{
+	for (int i = 0 ; i < 2 ; i++)
+	{
+		const double rate = fabs(u[i]) * v;
+		if (pl->max_rate[i] > 0 && rate > pl->max_rate[i])
+			v = pl->max_rate[i] / fabs(u[i]);
+	}
+
+	return v;
+}
+
+
+/** Fastest speed through the junction from the unit vector u0 into u1,
+ * in mm/s, capped at the nominal speed of the slower move.
+ */
+static inline double
+planner_junction_speed(
+	const planner_t * const pl,
+	const double * const u0,
+	const double * const u1,
+	const double nominal
+)
+{
+	const double cos_theta = -(u0[0] * u1[0] + u0[1] * u1[1]);
+	if (cos_theta > 0.999999)
+		return 0; // reversing direction
+
+	if (cos_theta < -0.999999)
+		return nominal; // straight through
+
+	const double sin_theta_d2 = sqrt(0.5 * (1 - cos_theta));
+	const double v = sqrt(pl->acceleration * pl->junction_deviation
+		* sin_theta_d2 / (1 - sin_theta_d2));
+
+	return v < nominal ? v : nominal;
+}
+
+
+/** Fastest speed at the start of a move of dist mm that must be able
+ * to slow down to v1 by its end.
+ */
+static inline double
+planner_max_entry(
+	const planner_t * const pl,
+	const double dist,
+	const double v1
+)
+{
+	return sqrt(v1 * v1 + 2 * pl->acceleration * dist);
+}
+
+
+/** Time for a trapezoidal move of dist mm that enters at v0, cruises
+ * at up to v and leaves at v1; the endpoint speeds must be reachable.
+ */
+static inline double
+planner_trapezoid_time(
+	const planner_t * const pl,
+	const double dist,
+	const double v0,
+	const double v,
+	const double v1
+)
+{
+	const double a = pl->acceleration;
+	if (dist <= 0)
+		return 0;
+
+	const double accel_dist = (v * v - v0 * v0) / (2 * a);
+	const double decel_dist = (v * v - v1 * v1) / (2 * a);
+
+	if (accel_dist + decel_dist <= dist)
+		return (v - v0) / a + (v - v1) / a
+			+ (dist - accel_dist - decel_dist) / v;
+
+	// triangle: never reaches the cruise speed
+	const double peak = sqrt((2 * a * dist + v0 * v0 + v1 * v1) / 2);
+	return (peak - v0) / a + (peak - v1) / a;
+}
+
+
+/** Time for a move of l1,l2 in motor space at speed v, from a
+ * standstill to a standstill, as for a pen up transit.
+ */
+static inline double
+planner_move_time(
+	const planner_t * const pl,
+	const double l1,
+	const double l2,
+	const double v
+)
+{
+	const double dist = sqrt(l1 * l1 + l2 * l2);
+	if (dist <= 0)
+		return 0;
+
+	const double u[2] = { l1 / dist, l2 / dist };
+	return planner_trapezoid_time(pl, dist, 0, planner_nominal(pl, u, v), 0);
+}
+
+#endif
@@ -0,0 +1,84 @@
+/** \file
+ * Polargraph kinematics.
+ *
+ * The two pulleys are width mm apart at the top corners of the wall,
+ * with x to the right and y down from the left pulley.  The motors are
+ * driven in string lengths relative to the home position, where both
+ * strings are home_length long and the pen hangs in the middle, and
+ * then scaled by steps_per_mm to correct for a misconfigured board.
+ */
+#ifndef _polar_h_
+#define _polar_h_
+
+#include <math.h>
+
+typedef struct
+{
+	double width;
+	double home_length;
+	double steps_per_mm;
+
+	// derived: height of the home point below the pulleys
+	double height;
+} polar_t;
+
+
+/** Fill in the derived values; returns -1 if the home point
+ * can not be reached with strings of home_length.
+ */
+static inline int
+polar_init(
+	polar_t * const p
+)
+{
+	// assume the zero-zero point is in the center (width/2) and
+	// the triangles are right. length^2 = (width/2)^2 + height^2
+	const double h2 = p->home_length * p->home_length
+		- p->width * p->width / 4.0;
+	if (h2 <= 0)
+		return -1;
+
+	p->height = sqrt(h2);
+	return 0;
+}
+
+
+/** Motor space position of the wall point x,y. */
+static inline void
+polar_lengths(
+	const polar_t * const p,
+	const double x,
+	const double y,
+	double * const l1,
+	double * const l2
+)
+{
+	const double rx = p->width - x;
+	*l1 = (sqrt(x*x + y*y) - p->home_length) * p->steps_per_mm;
+	*l2 = (sqrt(rx*rx + y*y) - p->home_length) * p->steps_per_mm;
+}
+
+
+/** Wall position of the motor space point l1,l2, the inverse of
+ * polar_lengths().  The pen is assumed to hang below the pulleys.
+ */
+static inline void
+polar_position(
+	const polar_t * const p,
+	const double l1,
+	const double l2,
+	double * const x,
+	double * const y
+)
+{
+	const double r1 = l1 / p->steps_per_mm + p->home_length;
+	const double r2 = l2 / p->steps_per_mm + p->home_length;
+	const double w = p->width;
+
+	*x = (r1*r1 - r2*r2 + w*w) / (2 * w);
+
+	const double y2 = r1*r1 - *x * *x;
+	*y = y2 > 0 ? sqrt(y2) : 0;
+}
+
+#endif
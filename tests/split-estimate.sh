@@ -0,0 +1,40 @@
+#!/bin/sh
+# The estimate for a single --split strip should be the same as the
+# Transit: lines of the ordinary sort, which starts from the same
+# place.  The drawing is made to start at x=0 so that the strip is not
+# moved, and the drawing time is left out with a very fast --feed.
+#
+# Usage: tests/split-estimate.sh [./vecsort]
+vecsort=${1:-./vecsort}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+awk 'BEGIN {
+	srand(1);
+	for (p = 0 ; p < 3 ; p++) {
+		printf "P %d %d %d\n", p == 0 ? 100 : 0, p == 1 ? 100 : 0, p == 2 ? 100 : 0;
+		printf "M 0 %d\nL 5 %d\n", p * 10, p * 10;
+		for (i = 0 ; i < 200 ; i++)
+			printf "M %.3f %.3f\nL %.3f %.3f\n",
+				rand() * 400, rand() * 400, rand() * 400, rand() * 400;
+	}
+}' > "$dir/in.vec"
+
+status=0
+for cost in distance time
+do
+	sum=$("$vecsort" --cost $cost --transit 60 < "$dir/in.vec" 2>&1 >/dev/null |
+		awk '/^Transit:/ { t += $2 } END { printf "%.0f", t }')
+	part=$("$vecsort" --cost $cost --transit 60 --feed 1e15 \
+		--split 1 --split-output "$dir/part%d" < "$dir/in.vec" 2>&1 |
+		sed -n 's/^Part 0: .*, about \([0-9]*\) sec$/\1/p')
+
+	# the Transit: lines are each rounded, so allow for a second a pass
+	if [ -z "$part" ] || [ $((part - sum)) -gt 3 ] || [ $((sum - part)) -gt 3 ]
+	then
+		echo "--cost $cost: split estimate ${part:-missing} sec, sort $sum" >&2
+		status=1
+	fi
+done
+
+exit $status
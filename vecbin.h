@@ -0,0 +1,226 @@
+/** \file
+ * Binary vector format, an alternative to the text P/M/L/Z lines.
+ *
+ * The file is a header followed by blocks of polylines.  Every field
+ * is a little endian 32 bit word, and the coordinates are fixed point
+ * in VECBIN_UNITS per mm, which is exactly what the text format holds
+ * with its three decimals.
+ *
+ *	header:	"VECB", version, units per mm, 0
+ *	block:	colour (the three numbers of the P line), flags,
+ *		paths, points,
+ *		then the number of points in each path,
+ *		then the x,y of every point
+ *
+ * A block with VECBIN_LAYER starts a new colour, like a P line; without
+ * it the block carries on with the current one.  Each path starts with
+ * a move to its first point, except that with VECBIN_CONTINUE the first
+ * path carries on from the end of the previous block.
+ *
+ * Every block is a whole number of words, so a mapped file can be
+ * walked in place with vecbin_next() without copying or parsing.
+ */
+#ifndef _vecbin_h_
+#define _vecbin_h_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "vecbin.h assumes a little endian host"
+#endif
+
+#define VECBIN_MAGIC "VECB"
+#define VECBIN_VERSION 1
+#define VECBIN_UNITS 1000
+
+#define VECBIN_LAYER 1
+#define VECBIN_CONTINUE 2
+
+typedef struct
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t units;
+	uint32_t reserved;
+} vecbin_header_t;
+
+typedef struct
+{
+	int32_t color[3]; // the three numbers of the P line
+	uint32_t flags;
+	uint32_t paths;
+	uint32_t points;
+} vecbin_block_t;
+
+typedef struct
+{
+	const uint8_t * base;
+	size_t size;
+	size_t pos;
+	int mapped;
+} vecbin_t;
+
+
+/** Does a file that starts with these len bytes hold binary vectors? */
+static inline int
+vecbin_is(
+	const void * const head,
+	const size_t len
+)
+{
+	return len >= 4 && memcmp(head, VECBIN_MAGIC, 4) == 0;
+}
+
+
+static inline void
+vecbin_close(
+	vecbin_t * const vb
+)
+{
+	if (vb->mapped)
+		munmap((void *) vb->base, vb->size);
+	else
+		free((void *) vb->base);
+	vb->base = NULL;
+}
+
+
+/** Open the binary vectors in f, of which the first len bytes have
+ * already been read into head.  A regular file is mapped; anything
+ * else, such as a pipe, is read into memory.  Returns -1 on an error.
+ */
+static inline int
+vecbin_open(
+	vecbin_t * const vb,
+	FILE * const f,
+	const void * const head,
+	const size_t len
+)
+{
+	memset(vb, 0, sizeof(*vb));
+
+	// head must be all that was read, which ftello() counts through
+	// the stdio buffer; the descriptor is already past it
+	const int fd = fileno(f);
+	struct stat st;
+	if (fstat(fd, &st) == 0
+	&&  S_ISREG(st.st_mode)
+	&&  st.st_size > 0
+	&&  ftello(f) == (off_t) len)
+	{
+		void * const base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (base != MAP_FAILED)
+		{
+			vb->base = base;
+			vb->size = st.st_size;
+			vb->mapped = 1;
+		}
+	}
+
+	if (!vb->mapped)
+	{
+		size_t size = len > 4096 ? len * 2 : 1 << 16;
+		uint8_t * buf = malloc(size);
+		if (!buf)
+			return -1;
+		memcpy(buf, head, len);
+		vb->size = len;
+
+		while (1)
+		{
+			if (vb->size == size)
+			{
+				uint8_t * const bigger = realloc(buf, size *= 2);
+				if (!bigger)
+				{
+					free(buf);
+					return -1;
+				}
+				buf = bigger;
+			}
+
+			const size_t got = fread(buf + vb->size, 1, size - vb->size, f);
+			if (!got)
+				break;
+			vb->size += got;
+		}
+
+		vb->base = buf;
+	}
+
+	vecbin_header_t hdr;
+	if (vb->size >= sizeof(hdr))
+		memcpy(&hdr, vb->base, sizeof(hdr));
+	if (vb->size < sizeof(hdr)
+	||  !vecbin_is(hdr.magic, sizeof(hdr.magic))
+	||  hdr.version != VECBIN_VERSION
+	||  hdr.units != VECBIN_UNITS)
+	{
+		vecbin_close(vb);
+		return -1;
+	}
+
+	vb->pos = sizeof(hdr);
+	return 0;
+}
+
+
+/** Step to the next block, pointing lens at its path lengths and xy
+ * at its points in place.  Returns 0 at the end, or -1 if the block
+ * is truncated or its path lengths do not add up.
+ */
+static inline int
+vecbin_next(
+	vecbin_t * const vb,
+	vecbin_block_t * const blk,
+	const uint32_t ** const lens,
+	const int32_t ** const xy
+)
+{
+	if (vb->pos == vb->size)
+		return 0;
+	if (vb->size - vb->pos < sizeof(*blk))
+		return -1;
+
+	memcpy(blk, vb->base + vb->pos, sizeof(*blk));
+	const size_t len = sizeof(*blk)
+		+ (size_t) blk->paths * sizeof(**lens)
+		+ (size_t) blk->points * 2 * sizeof(**xy);
+	if (vb->size - vb->pos < len)
+		return -1;
+
+	*lens = (const uint32_t *)(vb->base + vb->pos + sizeof(*blk));
+	*xy = (const int32_t *)(*lens + blk->paths);
+
+	uint64_t total = 0;
+	for (uint32_t i = 0 ; i < blk->paths ; i++)
+		total += (*lens)[i];
+	if (total != blk->points)
+		return -1;
+
+	vb->pos += len;
+	return 1;
+}
+
+
+/** Write the file header. */
+static inline void
+vecbin_write_header(
+	FILE * const f
+)
+{
+	const vecbin_header_t hdr = {
+		.magic = VECBIN_MAGIC,
+		.version = VECBIN_VERSION,
+		.units = VECBIN_UNITS,
+	};
+	fwrite(&hdr, sizeof(hdr), 1, f);
+}
+
+#endif
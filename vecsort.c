@@ -3,28 +3,74 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
 #include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "polar.h"
+#include "planner.h"
+#include "vecbin.h"
 
-typedef struct _vector vector_t;
-struct _vector
+/** Hash set of segments for duplicate detection.
+ *
+ * Segments are keyed on the grid-snapped cells of their two endpoints,
+ * sorted so that a segment and its reverse share a key.  The cells
+ * are much larger than the fpeq() tolerance, so a lookup only needs to
+ * probe a neighbouring cell when a coordinate is within the tolerance
+ * of a cell boundary; the entries found are then compared with fpeq()
+ * exactly as the old linear scan did.
+ */
+typedef struct
 {
-	vector_t * next;
-	vector_t ** prev;
-	double x1;
-	double y1;
-	double x2;
-	double y2;
-};
+	uint64_t key;
+	unsigned id; // index + 1 so that zero is an empty slot
+} vector_hash_entry_t;
 
+typedef struct
+{
+	vector_hash_entry_t * table;
+	size_t size;
+	size_t count;
+} vector_hash_t;
 
+/** Structure-of-arrays storage for the segments of one pass.
+ *
+ * The cut order is simply the position in the arrays; the optimizer
+ * permutes them in place so that every later stage is a linear walk.
+ * While parsing each pass grows its own arrays, and once the file has
+ * been read they are packed into a single arena for the whole job.
+ *
+ * The optional tag travels with each segment through every reordering
+ * and has its low bit flipped whenever the segment is reversed, which
+ * lets a caller find out where its segments ended up.
+ */
 typedef struct
 {
-	vector_t * vectors;
+	double * x1;
+	double * y1;
+	double * x2;
+	double * y2;
+	unsigned * tag;
+	unsigned count;
+	unsigned size;
+	vector_hash_t dups;
 } vectors_t;
 
 // Red/Green/Blue
 #define VECTOR_PASSES 3
 
+typedef struct
+{
+	vectors_t pass[VECTOR_PASSES];
+	double * arena;
+	const int * marker; // the pass that each pass is plotted with
+} vector_job_t;
+
 // close enough for floating point work
 static inline int fpeq(double x, double y)
 {
@@ -32,560 +78,5895 @@ static inline int fpeq(double x, double y)
 	return fabs(x-y) < eps;
 }
 
+// dedup grid spacing; must be well over twice the fpeq() tolerance.
+// The half cell offset keeps the usual 0.001 mm coordinates away
+// from the cell boundaries.
+#define VECTOR_HASH_GRID 1e-4
+#define VECTOR_HASH_SLOP 2e-8
+
+static inline int64_t
+vector_hash_snap(double x)
+{
+	return (int64_t) floor(x / VECTOR_HASH_GRID + 0.5);
+}
+
+
+static inline uint64_t
+vector_hash_key(
+	int64_t ax,
+	int64_t ay,
+	int64_t bx,
+	int64_t by
+)
+{
+	// normalize so that the reversed segment has the same key
+	if (bx < ax || (bx == ax && by < ay))
+	{
+		int64_t t;
+		t = ax; ax = bx; bx = t;
+		t = ay; ay = by; by = t;
+	}
+
+	uint64_t h = 0xcbf29ce484222325ULL;
+	const int64_t k[] = { ax, ay, bx, by };
+	for (int i = 0 ; i < 4 ; i++)
+	{
+		h ^= (uint64_t) k[i];
+		h *= 0x100000001b3ULL;
+		h ^= h >> 29;
+	}
+
+	return h;
+}
+
+
+static void
+vector_hash_insert(
+	vector_hash_t * const hash,
+	const uint64_t key,
+	const unsigned id
+)
+{
+	if ((hash->count + 1) * 2 > hash->size)
+	{
+		vector_hash_t bigger = {
+			.size = hash->size ? hash->size * 2 : 1024,
+			.count = 0,
+		};
+		bigger.table = calloc(bigger.size, sizeof(*bigger.table));
+		if (!bigger.table)
+		{
+			fprintf(stderr, "vector hash: out of memory\n");
+			exit(-1);
+		}
+
+		for (size_t i = 0 ; i < hash->size ; i++)
+			if (hash->table[i].id)
+				vector_hash_insert(&bigger, hash->table[i].key, hash->table[i].id);
+
+		free(hash->table);
+		*hash = bigger;
+	}
+
+	size_t i = key & (hash->size - 1);
+	while (hash->table[i].id)
+		i = (i + 1) & (hash->size - 1);
+
+	hash->table[i].key = key;
+	hash->table[i].id = id;
+	hash->count++;
+}
+
+
+static int
+vector_hash_probe(
+	const vectors_t * const vs,
+	const uint64_t key,
+	const double x1,
+	const double y1,
+	const double x2,
+	const double y2
+)
+{
+	const vector_hash_t * const hash = &vs->dups;
+	if (!hash->size)
+		return 0;
+
+	for (size_t i = key & (hash->size - 1)
+	;    hash->table[i].id
+	;    i = (i + 1) & (hash->size - 1))
+	{
+		if (hash->table[i].key != key)
+			continue;
+
+		const unsigned j = hash->table[i].id - 1;
+
+		if (fpeq(vs->x1[j],x1) && fpeq(vs->y1[j],y1)
+		&&  fpeq(vs->x2[j],x2) && fpeq(vs->y2[j],y2))
+			return 1;
+
+		if (fpeq(vs->x1[j],x2) && fpeq(vs->y1[j],y2)
+		&&  fpeq(vs->x2[j],x1) && fpeq(vs->y2[j],y1))
+			return 1;
+	}
+
+	return 0;
+}
+
+
+/** Check for an existing segment within fpeq() of x1,y1 -> x2,y2
+ * in either direction.
+ *
+ * Each coordinate usually snaps to one cell; near a boundary both
+ * candidate cells are tried, which is at most 16 probes and almost
+ * always exactly one.
+ */
+static int
+vector_hash_find(
+	const vectors_t * const vs,
+	const double x1,
+	const double y1,
+	const double x2,
+	const double y2
+)
+{
+	const double c[4] = { x1, y1, x2, y2 };
+	int64_t lo[4], hi[4];
+
+	for (int i = 0 ; i < 4 ; i++)
+	{
+		lo[i] = vector_hash_snap(c[i] - VECTOR_HASH_SLOP);
+		hi[i] = vector_hash_snap(c[i] + VECTOR_HASH_SLOP);
+	}
+
+	for (int64_t ax = lo[0] ; ax <= hi[0] ; ax++)
+	for (int64_t ay = lo[1] ; ay <= hi[1] ; ay++)
+	for (int64_t bx = lo[2] ; bx <= hi[2] ; bx++)
+	for (int64_t by = lo[3] ; by <= hi[3] ; by++)
+		if (vector_hash_probe(vs, vector_hash_key(ax, ay, bx, by), x1, y1, x2, y2))
+			return 1;
+
+	return 0;
+}
+
 
 static double
 vector_transit_len(
-	vector_t * v
+	const vectors_t * const vs,
+	const double sx,
+	const double sy
 )
 {
-	double lx = 0;
-	double ly = 0;
+	double lx = sx;
+	double ly = sy;
 
 	double transit_len_sum = 0;
 
-	while (v)
+	for (unsigned i = 0 ; i < vs->count ; i++)
 	{
-		double t_dx = lx - v->x1;
-		double t_dy = ly - v->y1;
+		double t_dx = lx - vs->x1[i];
+		double t_dy = ly - vs->y1[i];
 
 		double transit_len = sqrt(t_dx * t_dx + t_dy * t_dy);
 		if (transit_len != 0)
 			transit_len_sum += transit_len;
 
 		// Advance the point
-		lx = v->x2;
-		ly = v->y2;
-		v = v->next;
+		lx = vs->x2[i];
+		ly = vs->y2[i];
 	}
 
 	return transit_len_sum;
 }
 
 
+/** Running cut and transit totals.
+ *
+ * Tracks the current point so that stats can be accumulated over
+ * several runs of segments (the tiles in streaming mode) as well as
+ * a single pass.
+ */
+typedef struct
+{
+	double lx;
+	double ly;
+	double cut_len_sum;
+	unsigned cuts;
+	double transit_len_sum;
+	unsigned transits;
+} vector_stats_t;
+
+
 static void
-vector_stats(
-	vector_t * v
+vector_stats_add(
+	vector_stats_t * const st,
+	const vectors_t * const vs
 )
 {
-	double lx = 0;
-	double ly = 0;
-	double cut_len_sum = 0;
-	int cuts = 0;
+	double lx = st->lx;
+	double ly = st->ly;
 
-	double transit_len_sum = 0;
-	int transits = 0;
-
-	while (v)
+	for (unsigned i = 0 ; i < vs->count ; i++)
 	{
-		double t_dx = lx - v->x1;
-		double t_dy = ly - v->y1;
+		double t_dx = lx - vs->x1[i];
+		double t_dy = ly - vs->y1[i];
 
 		double transit_len = sqrt(t_dx * t_dx + t_dy * t_dy);
 		if (transit_len != 0)
 		{
-			transits++;
-			transit_len_sum += transit_len;
+			st->transits++;
+			st->transit_len_sum += transit_len;
 		}
 
-		double c_dx = v->x1 - v->x2;
-		double c_dy = v->y1 - v->y2;
+		double c_dx = vs->x1[i] - vs->x2[i];
+		double c_dy = vs->y1[i] - vs->y2[i];
 
 		double cut_len = sqrt(c_dx*c_dx + c_dy*c_dy);
 		if (cut_len != 0)
 		{
-			cuts++;
-			cut_len_sum += cut_len;
+			st->cuts++;
+			st->cut_len_sum += cut_len;
 		}
 
 		// Advance the point
-		lx = v->x2;
-		ly = v->y2;
-		v = v->next;
+		lx = vs->x2[i];
+		ly = vs->y2[i];
 	}
 
-	fprintf(stderr, "Cuts: %u len %.0f\n", cuts, cut_len_sum);
-	fprintf(stderr, "Move: %u len %.0f\n", transits, transit_len_sum);
+	st->lx = lx;
+	st->ly = ly;
 }
 
 
 static void
-vector_create(
-	vectors_t * const vectors,
-	double x1,
-	double y1,
-	double x2,
-	double y2
+vector_stats_print(
+	const vector_stats_t * const st
 )
 {
-	// Find the end of the list and, if vector optimization is
-	// turned on, check for duplicates
-	vector_t ** iter = &vectors->vectors;
-	while (*iter)
-	{
-		vector_t * const p = *iter;
+	fprintf(stderr, "Cuts: %u len %.0f\n", st->cuts, st->cut_len_sum);
+	fprintf(stderr, "Move: %u len %.0f\n", st->transits, st->transit_len_sum);
+}
 
-		if (fpeq(p->x1,x1) && fpeq(p->y1,y1)
-		&&  fpeq(p->x2,x2) && fpeq(p->y2,y2))
-			return;
 
-		if (fpeq(p->x1,x2) && fpeq(p->y1,y2)
-		&&  fpeq(p->x2,x1) && fpeq(p->y2,y1))
-			return;
+static double
+monotime(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
-		if (fpeq(x1,x2) && fpeq(y1,y2))
-			return;
 
-		iter = &p->next;
-	}
+#define VECTOR_DEDUP_SAMPLE 64
 
-	vector_t * const v = calloc(1, sizeof(*v));
-	if (!v)
-		return;
+/** What the greedy sort did, kept by each thread and added up. */
+typedef struct
+{
+	unsigned long long reversals; // segments drawn end to start
+	unsigned long long visits; // grid cells searched
+} vector_counts_t;
 
-	v->x1 = x1;
-	v->y1 = y1;
-	v->x2 = x2;
-	v->y2 = y2;
 
-	// Append it to the now known end of the list
-	v->next = NULL;
-	v->prev = iter;
-	*iter = v;
-}
+/** Totals for the whole run, for the summary at the end.  The stage
+ * times are wall clock, so with -j the optimise time is that of the
+ * parallel sort rather than the sum over the threads.
+ */
+static struct
+{
+	int timed; // time the duplicate check as well, for --stats=json
+	unsigned long long dedup_checks;
+	double parse; // including dropping the duplicates
+	double dedup;
+	double sort; // chaining, sorting and refining
+	double optimise;
+	double refine;
+	double emit;
+	double transit_in; // in the input order, or NAN for --stream
+	double transit; // of the output, starting from the origin
+	double x;
+	double y;
+	unsigned long long segments;
+	unsigned long long dups;
+	unsigned long long two_opt;
+	unsigned long long or_opt;
+	vector_counts_t counts;
+} vector_profile;
 
+static pthread_mutex_t vector_profile_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
-/**
- * Generate a list of vectors.
- *
- * The vector format is:
- * P r,g,b -- Color of the vector
- * M x,y -- Move (start a line at x,y)
- * L x,y -- Line to x,y from the current position
- * Z -- Closing line segment to the starting position
- *
- * Multi segment vectors are split into individual vectors, which are
- * then passed into the topological sort routine.
- *
- * Exact duplictes will be deleted to try to avoid double hits..
- */
-static vectors_t *
-vectors_parse(
-	FILE * const vector_file
+static void
+vector_stats(
+	const vectors_t * const vs
 )
 {
-	vectors_t * const vectors = calloc(VECTOR_PASSES, sizeof(*vectors));
-	double mx = 0, my = 0;
-	double lx = 0, ly = 0;
-	int pass = 0;
-	int count = 0;
+	vector_stats_t st = { 0 };
+	vector_stats_add(&st, vs);
+	vector_stats_print(&st);
+}
 
-	char buf[256];
 
-	while (fgets(buf, sizeof(buf), vector_file))
-	{
-		//fprintf(stderr, "read '%s'\n", buf);
-		const char cmd = buf[0];
-		double x, y;
+static void
+vector_grow(
+	vectors_t * const vs,
+	const unsigned size
+)
+{
+	double ** const arrays[] = { &vs->x1, &vs->y1, &vs->x2, &vs->y2 };
 
-		switch (cmd)
-		{
-		case 'P':
+	for (int i = 0 ; i < 4 ; i++)
+	{
+		double * const a = realloc(*arrays[i], size * sizeof(**arrays[i]));
+		if (!a)
 		{
-			// note that they will be in bgr order in the file
-			int r, g, b;
-			sscanf(buf+1, "%d %d %d", &b, &g, &r);
-			if (r == 0 && g != 0 && b == 0)
-			{
-				pass = 0;
-			} else
-			if (r != 0 && g == 0 && b == 0)
-			{
-				pass = 1;
-			} else
-			if (r == 0 && g == 0 && b != 0)
-			{
-				pass = 2;
-			} else {
-				fprintf(stderr, "non-red/green/blue vector? %d,%d,%d\n", r, g, b);
-				exit(-1);
-			}
-			break;
-		}
-		case 'M':
-			// Start a new line.
-			// This also implicitly sets the
-			// current laser position
-			sscanf(buf+1, "%lf %lf", &mx, &my);
-			lx = mx;
-			ly = my;
-			break;
-		case 'L':
-			// Add a line segment from the current
-			// point to the new point, and update
-			// the current point to the new point.
-			sscanf(buf+1, "%lf %lf", &x, &y);
-			vector_create(&vectors[pass], lx, ly, x, y);
-			count++;
-			lx = x;
-			ly = y;
-			break;
-		case 'Z':
-			// Closing segment from the current point
-			// back to the starting point
-			vector_create(&vectors[pass], lx, ly, mx, my);
-			lx = mx;
-			lx = my;
-			break;
-		case 'X':
-			goto done;
-		default:
-			fprintf(stderr, "Unknown command '%c'", cmd);
-			return NULL;
+			fprintf(stderr, "vectors: out of memory\n");
+			exit(-1);
 		}
+		*arrays[i] = a;
 	}
 
-done:
-	fprintf(stderr, "read %u segments\n", count);
-/*
-	for (int i = 0 ; i < VECTOR_PASSES ; i++)
+	vs->size = size;
+}
+
+
+static void
+vector_create(
+	vectors_t * const vectors,
+	double x1,
+	double y1,
+	double x2,
+	double y2
+)
+{
+	// Zero length segments are dropped, except as the very first one
+	// in a pass (which the old linear duplicate scan never checked).
+	if (vectors->count && fpeq(x1,x2) && fpeq(y1,y2))
+		return;
+
+	// Grown ahead of the check, even for a duplicate, so that the
+	// copy is not timed as part of it.
+	if (vectors->count == vectors->size)
+		vector_grow(vectors, vectors->size ? vectors->size * 2 : 1024);
+
+	// Exact duplicates, in either direction, are dropped.  Timing
+	// every check would take longer than the check itself, so only
+	// one in VECTOR_DEDUP_SAMPLE is timed and counted for them all,
+	// except that a check that rehashes the table is timed on its
+	// own, since the rare rehash would be scaled up with the sample.
+	const int rehash = vector_profile.timed
+		&& (vectors->dups.count + 1) * 2 > vectors->dups.size;
+	const int timed = rehash || (vector_profile.timed
+		&& vector_profile.dedup_checks++ % VECTOR_DEDUP_SAMPLE == 0);
+	const double scale = rehash ? 1 : VECTOR_DEDUP_SAMPLE;
+	const double start = timed ? monotime() : 0;
+	if (vector_hash_find(vectors, x1, y1, x2, y2))
 	{
-		vector_stats(vectors[i].vectors);
+		vector_profile.dups++;
+		if (timed)
+			vector_profile.dedup += (monotime() - start) * scale;
+		return;
 	}
 
-	fprintf(stderr, "---\n");
-*/
+	// Append it to the end of the pass
+	const unsigned i = vectors->count++;
+	vectors->x1[i] = x1;
+	vectors->y1[i] = y1;
+	vectors->x2[i] = x2;
+	vectors->y2[i] = y2;
 
-	return vectors;
+	vector_hash_insert(&vectors->dups,
+		vector_hash_key(
+			vector_hash_snap(x1), vector_hash_snap(y1),
+			vector_hash_snap(x2), vector_hash_snap(y2)
+		),
+		i + 1
+	);
+
+	if (timed)
+		vector_profile.dedup += (monotime() - start) * scale;
 }
 
 
-/** Find the closest vector to a given point and remove it from the list.
- *
- * This might reverse a vector if it is closest to draw it in reverse
- * order.
+/** Pack the per-pass arrays into one arena so that the whole job
+ * is contiguous and is released by vector_job_free().
  */
-static vector_t *
-vector_find_closest(
-	vector_t * v,
-	const double cx,
-	const double cy
+static void
+vector_job_pack(
+	vector_job_t * const job
 )
 {
-	double best_dist = 1e9;
-	vector_t * best = NULL;
-	int do_reverse = 0;
+	size_t total = 0;
+	for (int i = 0 ; i < VECTOR_PASSES ; i++)
+		total += job->pass[i].count;
 
-	while (v)
+	double * const arena = malloc((total * 4 + 1) * sizeof(*arena));
+	if (!arena)
 	{
-		double dx1 = cx - v->x1;
-		double dy1 = cy - v->y1;
-		double dist1 = dx1*dx1 + dy1*dy1;
+		fprintf(stderr, "vectors: out of memory\n");
+		exit(-1);
+	}
 
-		if (dist1 < best_dist)
-		{
-			best = v;
-			best_dist = dist1;
-			do_reverse = 0;
-		}
+	double * a = arena;
+	for (int i = 0 ; i < VECTOR_PASSES ; i++)
+	{
+		vectors_t * const vs = &job->pass[i];
+		const unsigned n = vs->count;
+		double ** const arrays[] = { &vs->x1, &vs->y1, &vs->x2, &vs->y2 };
 
-		double dx2 = cx - v->x2;
-		double dy2 = cy - v->y2;
-		double dist2 = dx2*dx2 + dy2*dy2;
-		if (dist2 < best_dist)
+		for (int j = 0 ; j < 4 ; j++)
 		{
-			best = v;
-			best_dist = dist2;
-			do_reverse = 1;
+			if (n)
+				memcpy(a, *arrays[j], n * sizeof(*a));
+			free(*arrays[j]);
+			*arrays[j] = a;
+			a += n;
 		}
 
-		v = v->next;
+		// The duplicate tables are not needed once the file is read
+		free(vs->dups.table);
+		memset(&vs->dups, 0, sizeof(vs->dups));
+		vs->size = n;
 	}
 
-	if (!best)
-		return NULL;
+	job->arena = arena;
+}
 
-	// Remove it from the list
-	if (best->prev)
-		*best->prev = best->next;
-	if (best->next)
-		best->next->prev = best->prev;
 
-	// If reversing is required, flip the x1/x2 and y1/y2
-	if (do_reverse)
-	{
-		double x1 = best->x1;
-		double y1 = best->y1;
-		best->x1 = best->x2;
-		best->y1 = best->y2;
-		best->x2 = x1;
-		best->y2 = y1;
-	}
+static void
+vector_job_free(
+	vector_job_t * const job
+)
+{
+	if (!job)
+		return;
+	free(job->arena);
+	free(job);
+}
 
-	best->next = NULL;
-	best->prev = NULL;
 
-	return best;
+/** Release a pass that was never packed into a job arena. */
+static void
+vectors_free(
+	vectors_t * const vs
+)
+{
+	free(vs->x1);
+	free(vs->y1);
+	free(vs->x2);
+	free(vs->y2);
+	free(vs->tag);
+	free(vs->dups.table);
+	memset(vs, 0, sizeof(*vs));
 }
 
 
-/**
- * Optimize the cut order to minimize transit time.
+
+/** Line reader and number parsing for the vector file.
  *
- * Simplistic greedy algorithm: look for the closest vector that starts
- * or ends at the same point as the current point. 
+ * The input is read in large blocks and split into lines in place, so
+ * lines of any length are handled without a copy or an allocation per
+ * line; the buffer only grows if a single line does not fit in it.
  *
- * This does not split vectors.
+ * Coordinates are almost always short decimals, which are converted
+ * exactly with one integer accumulation and a single division by a
+ * power of ten (both operands are exactly representable, so the result
+ * is correctly rounded, as strtod() would give).  Anything else, such
+ * as exponents, long mantissas or inf/nan, falls back to strtod().
  */
-static vector_t *
-vector_optimize(
-	vector_t ** vectors,
-	double *cx_ptr,
-	double *cy_ptr
+#define VECTOR_READ_BUFFER (1 << 20)
+
+typedef struct
+{
+	FILE * file;
+	char * buf;
+	size_t size;
+	size_t len;
+	size_t pos;
+	int eof;
+} vector_reader_t;
+
+
+/** Keep the unread part of the buffer and read more behind it,
+ * growing the buffer if it is already full.  Returns 0 at the end.
+ */
+static size_t
+vector_read_fill(
+	vector_reader_t * const rd
 )
 {
-	vector_t * vs = NULL;
-	vector_t * vs_tail = NULL;
-	double cx = *cx_ptr;
-	double cy = *cy_ptr;
+	rd->len -= rd->pos;
+	memmove(rd->buf, rd->buf + rd->pos, rd->len);
+	rd->pos = 0;
 
-	while (*vectors)
+	if (rd->len + 1 >= rd->size)
 	{
-		vector_t * v = vector_find_closest(*vectors, cx, cy);
-		if (!v)
+		const size_t size = rd->size ? rd->size * 2 : VECTOR_READ_BUFFER;
+		char * const buf = realloc(rd->buf, size);
+		if (!buf)
 		{
-			fprintf(stderr, "nothing close?\n");
-			abort();
-		}
-
-		if (!vs)
-		{
-			// Nothing on the list yet
-			vs = vs_tail = v;
-		} else {
-			// Add it to the tail of the list
-			v->next = NULL;
-			v->prev = &vs_tail->next;
-			vs_tail->next = v;
-			vs_tail = v;
+			fprintf(stderr, "read: out of memory\n");
+			exit(-1);
 		}
-		
-		// Move the current point to the end of the line segment
-		cx = v->x2;
-		cy = v->y2;
+		rd->buf = buf;
+		rd->size = size;
 	}
 
-	//vector_stats(vs);
-	*cx_ptr = cx;
-	*cy_ptr = cy;
+	const size_t got = fread(rd->buf + rd->len, 1, rd->size - rd->len - 1, rd->file);
+	if (!got)
+		rd->eof = 1;
+	rd->len += got;
+	return got;
+}
 
-	// update the pointers
-	*vectors = vs;
-	if (vs)
-		vs->prev = vectors;
 
-	return vs;
+/** Make sure that at least n bytes are buffered, if there are that
+ * many left, and return how many are.
+ */
+static size_t
+vector_read_peek(
+	vector_reader_t * const rd,
+	const size_t n
+)
+{
+	while (rd->len - rd->pos < n && !rd->eof)
+		vector_read_fill(rd);
+	return rd->len - rd->pos;
 }
 
 
-/*
- * Attempt to remove long transits.
- * Find the longest transit and attempt to move that point
- * to a closer point.  Then check to see if it reduces the transit.
- * returns the reduction in distance
- */
-static double
-vector_refine(
-	vector_t * const vector,
-	double *cx_ptr,
-	double *cy_ptr
+/** Return the next character, or EOF at the end. */
+static inline int
+vector_read_char(
+	vector_reader_t * const rd
 )
 {
-	const double initial_transit_len = vector_transit_len(vector);
-	double cx = *cx_ptr;
-	double cy = *cy_ptr;
+	if (rd->pos == rd->len && (rd->eof || !vector_read_fill(rd)))
+		return EOF;
+	return (unsigned char) rd->buf[rd->pos++];
+}
 
-	// find the longest transit
-	vector_t * v = vector;
-	double max_transit = 0;
-	vector_t * transit_v = NULL;
 
-	while (v)
+/** Return the next line, without its newline, or NULL at the end. */
+static char *
+vector_read_line(
+	vector_reader_t * const rd
+)
+{
+	while (1)
 	{
-		double t_dx = cx - v->x1;
-		double t_dy = cy - v->y1;
+		char * const line = rd->buf + rd->pos;
+		char * const nl = memchr(line, '\n', rd->len - rd->pos);
+		if (nl)
+		{
+			*nl = '\0';
+			rd->pos = nl - rd->buf + 1;
+			return line;
+		}
+
+		if (rd->eof)
+		{
+			if (rd->pos == rd->len)
+				return NULL;
+
+			// last line without a newline
+			rd->buf[rd->len] = '\0';
+			rd->pos = rd->len;
+			return line;
+		}
+
+		// keep the partial line and refill behind it
+		vector_read_fill(rd);
+	}
+}
+
+
+static inline const char *
+vector_skip_space(
+	const char * p
+)
+{
+	while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\v' || *p == '\f')
+		p++;
+	return p;
+}
+
+
+/** Parse a double like sscanf("%lf"), returning the end of the number
+ * or NULL if there is none.
+ */
+static const char *
+vector_parse_double(
+	const char * p,
+	double * const out
+)
+{
+	static const double pow10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+		1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20,
+		1e21, 1e22,
+	};
+
+	p = vector_skip_space(p);
+	const char * const start = p;
+
+	const int neg = *p == '-';
+	if (*p == '-' || *p == '+')
+		p++;
+
+	uint64_t mant = 0;
+	int digits = 0; // significant digits in mant
+	int frac = 0;
+	int any = 0;
+
+	for ( ; *p >= '0' && *p <= '9' ; p++, any = 1)
+	{
+		mant = mant * 10 + (*p - '0');
+		if (mant)
+			digits++;
+	}
+
+	if (*p == '.')
+	{
+		for (p++ ; *p >= '0' && *p <= '9' ; p++, any = 1, frac++)
+		{
+			mant = mant * 10 + (*p - '0');
+			if (mant)
+				digits++;
+		}
+	}
+
+	// anything unusual goes the slow way
+	if (!any
+	||  digits > 15
+	||  frac >= (int)(sizeof(pow10) / sizeof(*pow10))
+	||  *p == 'e' || *p == 'E'
+	||  *p == 'x' || *p == 'X')
+	{
+		char * end;
+		const double v = strtod(start, &end);
+		if (end == start)
+			return NULL;
+		*out = v;
+		return end;
+	}
+
+	const double v = (double) mant / pow10[frac];
+	*out = neg ? -v : v;
+	return p;
+}
+
+
+/** Parse an int like sscanf("%d"), returning the end of the number or
+ * NULL if there is none.
+ */
+static const char *
+vector_parse_int(
+	const char * p,
+	int * const out
+)
+{
+	p = vector_skip_space(p);
+
+	const int neg = *p == '-';
+	if (*p == '-' || *p == '+')
+		p++;
+
+	if (*p < '0' || *p > '9')
+		return NULL;
+
+	int v = 0;
+	for ( ; *p >= '0' && *p <= '9' ; p++)
+		v = v * 10 + (*p - '0');
+
+	*out = neg ? -v : v;
+	return p;
+}
+
+
+/** Parse up to two coordinates, stopping at the first that fails. */
+static void
+vector_parse_xy(
+	const char * p,
+	double * const x,
+	double * const y
+)
+{
+	if ((p = vector_parse_double(p, x)) != NULL)
+		vector_parse_double(p, y);
+}
+
+
+/** Receives each segment from the parser, along with its pass. */
+typedef void (*vector_sink_fn)(
+	void * arg,
+	int pass,
+	double x1,
+	double y1,
+	double x2,
+	double y2
+);
+
+
+/** The pass for the colour of a P line, which must be pure red,
+ * green or blue.
+ */
+static int
+vector_pass(
+	const int r,
+	const int g,
+	const int b
+)
+{
+	if (r == 0 && g != 0 && b == 0)
+		return 0;
+	if (r != 0 && g == 0 && b == 0)
+		return 1;
+	if (r == 0 && g == 0 && b != 0)
+		return 2;
+
+	fprintf(stderr, "non-red/green/blue vector? %d,%d,%d\n", r, g, b);
+	exit(-1);
+}
+
+
+/** Read the binary format, see vecbin.h, straight out of the mapped
+ * file: each point is handed to the sink as it is, with no parsing.
+ */
+static int
+vectors_read_bin(
+	vector_reader_t * const rd,
+	vector_sink_fn sink,
+	void * const arg
+)
+{
+	vecbin_t vb;
+	if (vecbin_open(&vb, rd->file, rd->buf + rd->pos, rd->len - rd->pos) < 0)
+	{
+		fprintf(stderr, "binary: bad header\n");
+		return -1;
+	}
+
+	const double unit = 1.0 / VECBIN_UNITS;
+	double lx = 0, ly = 0;
+	int pass = 0;
+	int count = 0;
+	int rc;
+
+	vecbin_block_t blk;
+	const uint32_t * lens;
+	const int32_t * xy;
+
+	while ((rc = vecbin_next(&vb, &blk, &lens, &xy)) > 0)
+	{
+		// only a layer block changes the pass, as a P line does; the
+		// colour is stored in the same bgr order as the P line
+		if (blk.flags & VECBIN_LAYER)
+			pass = vector_pass(blk.color[2], blk.color[1], blk.color[0]);
+
+		for (uint32_t i = 0 ; i < blk.paths ; i++)
+		{
+			uint32_t n = lens[i];
+			if (i != 0 || !(blk.flags & VECBIN_CONTINUE))
+			{
+				if (!n)
+					continue;
+				lx = xy[0] * unit;
+				ly = xy[1] * unit;
+				xy += 2;
+				n--;
+			}
+
+			for ( ; n ; n--, xy += 2)
+			{
+				const double x = xy[0] * unit;
+				const double y = xy[1] * unit;
+				sink(arg, pass, lx, ly, x, y);
+				count++;
+				lx = x;
+				ly = y;
+			}
+		}
+	}
+
+	vecbin_close(&vb);
+
+	if (rc < 0)
+	{
+		fprintf(stderr, "binary: truncated block\n");
+		return -1;
+	}
+
+	return count;
+}
+
+
+/** HPGL plotter units, 40 to the mm. */
+#define VECTOR_HPGL_UNIT 0.025
+
+static inline int
+vector_hpgl_letter(
+	const int c
+)
+{
+	return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+}
+
+
+static inline int
+vector_hpgl_number(
+	const int c
+)
+{
+	return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.';
+}
+
+
+/** The file is HPGL if it starts with a two letter mnemonic, such as
+ * IN or PU, or with an escape sequence or PJL wrapper around one.
+ */
+static int
+vector_is_hpgl(
+	vector_reader_t * const rd
+)
+{
+	if (vector_read_peek(rd, 2) < 2)
+		return 0;
+
+	const char * const p = rd->buf + rd->pos;
+	return p[0] == '\033' || p[0] == '@'
+		|| (vector_hpgl_letter(p[0]) && vector_hpgl_letter(p[1]));
+}
+
+
+/**
+ * Read HPGL plotter commands.
+ *
+ * The input is tokenized a character at a time rather than by line, so
+ * the long coordinate lists of PU and PD are never buffered; each pair
+ * is handed to the sink as soon as it has been read.  PU, PD, PA and PR
+ * move the pen (drawing a segment for each point while it is down), IN
+ * resets it and SP 1 to 3 select the pass.  Everything else, along with
+ * escape sequences, PJL lines and LB labels, is skipped.  Coordinates
+ * are converted from plotter units to mm but are otherwise unchanged.
+ */
+static int
+vectors_read_hpgl(
+	vector_reader_t * const rd,
+	vector_sink_fn sink,
+	void * const arg
+)
+{
+	double px = 0, py = 0;
+	int down = 0;
+	int relative = 0;
+	int pass = 0;
+	int count = 0;
+
+	int c = vector_read_char(rd);
+	while (c != EOF)
+	{
+		if (c == '\033')
+		{
+			// PCL or UEL escape, up to its final letter
+			do {
+				c = vector_read_char(rd);
+			} while (c != EOF && !(c >= '@' && c <= 'Z'));
+			c = vector_read_char(rd);
+			continue;
+		}
+
+		if (c == '@')
+		{
+			// PJL command
+			while (c != EOF && c != '\n')
+				c = vector_read_char(rd);
+			continue;
+		}
+
+		if (!vector_hpgl_letter(c))
+		{
+			// terminators and whitespace between commands
+			c = vector_read_char(rd);
+			continue;
+		}
+
+		const int c2 = vector_read_char(rd);
+		const int op = (c & ~0x20) << 8 | (c2 & ~0x20);
+		c = vector_read_char(rd);
+
+		if (op == ('L' << 8 | 'B'))
+		{
+			// label text runs to the ETX
+			while (c != EOF && c != '\003')
+				c = vector_read_char(rd);
+			c = vector_read_char(rd);
+			continue;
+		}
+
+		switch (op)
+		{
+		case 'P' << 8 | 'U': down = 0; break;
+		case 'P' << 8 | 'D': down = 1; break;
+		case 'P' << 8 | 'A': relative = 0; break;
+		case 'P' << 8 | 'R': relative = 1; break;
+		case 'I' << 8 | 'N': down = relative = 0; break;
+		default: break;
+		}
+
+		// the parameters, one number at a time
+		double xy[2];
+		int n = 0;
+
+		while (1)
+		{
+			while (c == ' ' || c == ',' || c == '\t' || c == '\r' || c == '\n')
+				c = vector_read_char(rd);
+
+			if (c == EOF || !vector_hpgl_number(c))
+				break;
+
+			char num[64];
+			size_t len = 0;
+			for ( ; c != EOF && vector_hpgl_number(c) ; c = vector_read_char(rd))
+				if (len < sizeof(num) - 1)
+					num[len++] = c;
+			num[len] = '\0';
+
+			double v;
+			if (!vector_parse_double(num, &v))
+				continue;
+
+			if (op == ('S' << 8 | 'P'))
+			{
+				const int pen = v;
+				if (pen > VECTOR_PASSES)
+				{
+					fprintf(stderr, "hpgl: pen %d has no pass\n", pen);
+					exit(-1);
+				}
+				if (pen > 0)
+					pass = pen - 1;
+				continue;
+			}
+
+			if (op != ('P' << 8 | 'U') && op != ('P' << 8 | 'D')
+			&&  op != ('P' << 8 | 'A') && op != ('P' << 8 | 'R'))
+				continue;
+
+			xy[n++] = v * VECTOR_HPGL_UNIT;
+			if (n < 2)
+				continue;
+			n = 0;
+
+			const double x = relative ? px + xy[0] : xy[0];
+			const double y = relative ? py + xy[1] : xy[1];
+			if (down)
+			{
+				sink(arg, pass, px, py, x, y);
+				count++;
+			}
+
+			px = x;
+			py = y;
+		}
+	}
+
+	return count;
+}
+
+
+/**
+ * Read a list of vectors.
+ *
+ * The vector format is:
+ * P r,g,b -- Color of the vector
+ * M x,y -- Move (start a line at x,y)
+ * L x,y -- Line to x,y from the current position
+ * Z -- Closing line segment to the starting position
+ *
+ * Multi segment vectors are split into individual vectors, which are
+ * handed to the sink one at a time.  Lines may be of any length.
+ * Returns the number of segments read, or -1 on a parse error.
+ *
+ * HPGL files are recognised by their first command and binary ones by
+ * their magic, and are read with vectors_read_hpgl() or
+ * vectors_read_bin() instead.
+ */
+static int
+vectors_read(
+	FILE * const vector_file,
+	vector_sink_fn sink,
+	void * const arg
+)
+{
+	double mx = 0, my = 0;
+	double lx = 0, ly = 0;
+	int pass = 0;
+	int count = 0;
+
+	vector_reader_t rd = { .file = vector_file };
+	char * buf;
+
+	if (vecbin_is(rd.buf + rd.pos, vector_read_peek(&rd, 4)))
+	{
+		count = vectors_read_bin(&rd, sink, arg);
+		if (count < 0)
+		{
+			free(rd.buf);
+			return -1;
+		}
+		goto done;
+	}
+
+	if (vector_is_hpgl(&rd))
+	{
+		count = vectors_read_hpgl(&rd, sink, arg);
+		goto done;
+	}
+
+	while ((buf = vector_read_line(&rd)) != NULL)
+	{
+		//fprintf(stderr, "read '%s'\n", buf);
+		const char cmd = buf[0] ? buf[0] : '\n';
+		double x = 0, y = 0;
+
+		switch (cmd)
+		{
+		case 'P':
+		{
+			// note that they will be in bgr order in the file
+			int r = 0, g = 0, b = 0;
+			const char * p = buf + 1;
+			if ((p = vector_parse_int(p, &b)) != NULL
+			&&  (p = vector_parse_int(p, &g)) != NULL)
+				vector_parse_int(p, &r);
+			pass = vector_pass(r, g, b);
+			break;
+		}
+		case 'M':
+			// Start a new line.
+			// This also implicitly sets the
+			// current laser position
+			vector_parse_xy(buf+1, &mx, &my);
+			lx = mx;
+			ly = my;
+			break;
+		case 'L':
+			// Add a line segment from the current
+			// point to the new point, and update
+			// the current point to the new point.
+			vector_parse_xy(buf+1, &x, &y);
+			sink(arg, pass, lx, ly, x, y);
+			count++;
+			lx = x;
+			ly = y;
+			break;
+		case 'Z':
+			// Closing segment from the current point
+			// back to the starting point
+			sink(arg, pass, lx, ly, mx, my);
+			lx = mx;
+			lx = my;
+			break;
+		case 'X':
+			goto done;
+		default:
+			fprintf(stderr, "Unknown command '%c'", cmd);
+			free(rd.buf);
+			return -1;
+		}
+	}
+
+done:
+	free(rd.buf);
+	fprintf(stderr, "read %u segments\n", count);
+	return count;
+}
+
+
+static void
+vector_job_sink(
+	void * const arg,
+	const int pass,
+	const double x1,
+	const double y1,
+	const double x2,
+	const double y2
+)
+{
+	vector_job_t * const job = arg;
+	vector_create(&job->pass[job->marker[pass]], x1, y1, x2, y2);
+}
+
+
+/**
+ * Generate a list of vectors for the whole job.
+ *
+ * Exact duplictes will be deleted to try to avoid double hits..
+ */
+static vector_job_t *
+vectors_parse(
+	FILE * const vector_file,
+	const int * const marker
+)
+{
+	vector_job_t * const job = calloc(1, sizeof(*job));
+	job->marker = marker;
+	const int count = vectors_read(vector_file, vector_job_sink, job);
+
+	vector_job_pack(job);
+	if (count < 0)
+	{
+		vector_job_free(job);
+		return NULL;
+	}
+
+/*
+	for (int i = 0 ; i < VECTOR_PASSES ; i++)
+	{
+		vector_stats(&job->pass[i]);
+	}
+
+	fprintf(stderr, "---\n");
+*/
+
+	return job;
+}
+
+
+/** Uniform grid over the endpoints of the unsorted vectors.
+ *
+ * Each vector is entered twice, once for each end, with an id of
+ * seq*2+end where seq is its position in the original list.  Ties are
+ * broken on the lowest id, which is exactly the way the old linear
+ * scan did it: lowest distance, then earliest vector, then the x1,y1
+ * end before the x2,y2 end.
+ *
+ * The points are stored as separate x, y and id arrays, grouped by
+ * cell, so that the distance kernel can load several at once.
+ * Removal swaps the last point of the cell into the hole.  As the
+ * grid empties it is rebuilt with a coarser spacing so that the ring
+ * search does not spend its time walking empty cells.
+ */
+typedef struct vector_cost vector_cost_t; // with the sort cost models
+
+typedef struct
+{
+	unsigned count;
+	unsigned live;
+	unsigned built;
+
+	double min_x;
+	double min_y;
+	double max_x;
+	double max_y;
+	double cell;
+	int cols;
+	int rows;
+
+	unsigned * cell_start;
+	unsigned * cell_len;
+	unsigned * where;
+	double * px;
+	double * py;
+	unsigned * pid;
+
+	unsigned long long visits; // cells searched by vector_index_closest()
+	const vector_cost_t * cost; // to rank the moves by, or NULL for the distance
+} vector_index_t;
+
+// Average number of vectors per grid cell
+#define VECTOR_CELL_DENSITY 2
+
+
+static inline int
+vector_index_cell(
+	const vector_index_t * const idx,
+	const double x,
+	const double y
+)
+{
+	int cx = (x - idx->min_x) / idx->cell;
+	int cy = (y - idx->min_y) / idx->cell;
+	if (cx < 0) cx = 0;
+	if (cx >= idx->cols) cx = idx->cols - 1;
+	if (cy < 0) cy = 0;
+	if (cy >= idx->rows) cy = idx->rows - 1;
+	return cy * idx->cols + cx;
+}
+
+
+static void *
+vector_index_alloc(
+	size_t count,
+	size_t size
+)
+{
+	void * const p = calloc(count + 1, size);
+	if (!p)
+	{
+		fprintf(stderr, "vector index: out of memory\n");
+		exit(-1);
+	}
+	return p;
+}
+
+
+/** (Re)build the grid from the points that are still live.
+ *
+ * The spacing is chosen for a few vectors per cell; the grid is
+ * never more than a few times larger than the live point count, even
+ * for degenerate (horizontal or vertical) inputs.
+ */
+static void
+vector_index_build(
+	vector_index_t * const idx
+)
+{
+	const unsigned npoints = idx->live * 2;
+	const unsigned old_cells = idx->cols * idx->rows;
+	double * const old_x = idx->px;
+	double * const old_y = idx->py;
+	unsigned * const old_id = idx->pid;
+
+	double min_x = 1e300, min_y = 1e300;
+	double max_x = -1e300, max_y = -1e300;
+
+	for (unsigned c = 0 ; c < old_cells ; c++)
+	{
+		const unsigned base = idx->cell_start[c];
+		for (unsigned i = base ; i < base + idx->cell_len[c] ; i++)
+		{
+			if (old_x[i] < min_x) min_x = old_x[i];
+			if (old_x[i] > max_x) max_x = old_x[i];
+			if (old_y[i] < min_y) min_y = old_y[i];
+			if (old_y[i] > max_y) max_y = old_y[i];
+		}
+	}
+
+	const double w = max_x - min_x;
+	const double h = max_y - min_y;
+	const double ncells = idx->live / VECTOR_CELL_DENSITY + 1;
+	double cell = sqrt(w * h / ncells);
+	if (cell < w / ncells)
+		cell = w / ncells;
+	if (cell < h / ncells)
+		cell = h / ncells;
+	if (!(cell > 0))
+		cell = 1;
+
+	idx->min_x = min_x;
+	idx->min_y = min_y;
+	idx->max_x = max_x;
+	idx->max_y = max_y;
+	idx->cell = cell;
+	idx->cols = w / cell + 1;
+	idx->rows = h / cell + 1;
+
+	const unsigned cells = idx->cols * idx->rows;
+	unsigned * const start = vector_index_alloc(cells + 1, sizeof(*start));
+	unsigned * const len = vector_index_alloc(cells, sizeof(*len));
+	double * const px = vector_index_alloc(npoints, sizeof(*px));
+	double * const py = vector_index_alloc(npoints, sizeof(*py));
+	unsigned * const pid = vector_index_alloc(npoints, sizeof(*pid));
+
+	// Counting sort of the live points into their cells
+	for (unsigned c = 0 ; c < old_cells ; c++)
+	{
+		const unsigned base = idx->cell_start[c];
+		for (unsigned i = base ; i < base + idx->cell_len[c] ; i++)
+			start[vector_index_cell(idx, old_x[i], old_y[i]) + 1]++;
+	}
+
+	for (unsigned c = 0 ; c < cells ; c++)
+		start[c+1] += start[c];
+
+	for (unsigned c = 0 ; c < old_cells ; c++)
+	{
+		const unsigned base = idx->cell_start[c];
+		for (unsigned i = base ; i < base + idx->cell_len[c] ; i++)
+		{
+			const int nc = vector_index_cell(idx, old_x[i], old_y[i]);
+			const unsigned pos = start[nc] + len[nc]++;
+			px[pos] = old_x[i];
+			py[pos] = old_y[i];
+			pid[pos] = old_id[i];
+			idx->where[old_id[i]] = pos;
+		}
+	}
+
+	free(old_x);
+	free(old_y);
+	free(old_id);
+	free(idx->cell_start);
+	free(idx->cell_len);
+
+	idx->cell_start = start;
+	idx->cell_len = len;
+	idx->px = px;
+	idx->py = py;
+	idx->pid = pid;
+	idx->built = idx->live;
+}
+
+
+static void
+vector_index_init(
+	vector_index_t * const idx,
+	const vectors_t * const vs,
+	const unsigned first
+)
+{
+	const unsigned count = vs->count - first;
+
+	memset(idx, 0, sizeof(*idx));
+	idx->where = vector_index_alloc(count * 2, sizeof(*idx->where));
+	idx->px = vector_index_alloc(count * 2, sizeof(*idx->px));
+	idx->py = vector_index_alloc(count * 2, sizeof(*idx->py));
+	idx->pid = vector_index_alloc(count * 2, sizeof(*idx->pid));
+	idx->cell_start = vector_index_alloc(1, sizeof(*idx->cell_start));
+	idx->cell_len = vector_index_alloc(1, sizeof(*idx->cell_len));
+
+	// Start with everything in a single cell and let the
+	// build sort the points into a proper grid.
+	idx->cols = idx->rows = 1;
+	for (unsigned seq = 0 ; seq < count ; seq++)
+	{
+		const unsigned i = first + seq;
+		idx->px[seq*2+0] = vs->x1[i];
+		idx->py[seq*2+0] = vs->y1[i];
+		idx->pid[seq*2+0] = seq*2+0;
+		idx->px[seq*2+1] = vs->x2[i];
+		idx->py[seq*2+1] = vs->y2[i];
+		idx->pid[seq*2+1] = seq*2+1;
+	}
+
+	idx->count = idx->live = count;
+	idx->cell_len[0] = count * 2;
+	vector_index_build(idx);
+}
+
+
+static void
+vector_index_free(
+	vector_index_t * const idx
+)
+{
+	free(idx->where);
+	free(idx->px);
+	free(idx->py);
+	free(idx->pid);
+	free(idx->cell_start);
+	free(idx->cell_len);
+}
+
+
+static void
+vector_index_remove(
+	vector_index_t * const idx,
+	const unsigned seq
+)
+{
+	for (unsigned end = 0 ; end < 2 ; end++)
+	{
+		const unsigned pos = idx->where[seq * 2 + end];
+		const int c = vector_index_cell(idx, idx->px[pos], idx->py[pos]);
+		const unsigned last = idx->cell_start[c] + --idx->cell_len[c];
+
+		idx->px[pos] = idx->px[last];
+		idx->py[pos] = idx->py[last];
+		idx->pid[pos] = idx->pid[last];
+		idx->where[idx->pid[pos]] = pos;
+
+		// The vacated slot can never be closest, so a full
+		// scan can run over the whole array without the holes
+		idx->px[last] = idx->py[last] = INFINITY;
+	}
+
+	idx->live--;
+
+	// Once three-quarters of the grid is empty, rebuild it.
+	if (idx->live > 64 && idx->live < idx->built / 4)
+		vector_index_build(idx);
+}
+
+
+static inline double
+dist(
+	const double x1,
+	const double y1,
+	const double x2,
+	const double y2
+)
+{
+	const double dx = x1 - x2;
+	const double dy = y1 - y2;
+	return sqrt(dx*dx + dy*dy);
+}
+
+
+/** Sort cost models.
+ *
+ * The sort normally minimises the cartesian length of the pen up
+ * moves.  A cost model instead maps every endpoint into a sort space
+ * and prices each move there with its transit function.  The sort
+ * runs on a mapped copy of the pass, which is put back into the order
+ * that was found just like the chains.
+ *
+ * The greedy sort picks the cheapest next move by the model, using
+ * the bound, the least that a move of a given length in the sort
+ * space can cost, to know when the ring search of the index can stop.
+ * The refinement weighs its moves by the model too, which matters for
+ * the time: acceleration makes two short moves slower than one long
+ * one of the same total length.
+ *
+ * The time model places the plot on the wall with the machine geometry
+ * and maps it to string lengths, where the origin is the home position
+ * that the pen starts from.  The firmware moves both strings along a
+ * straight line in that space, and the time is the planner's for that
+ * move from a standstill to a standstill, at the transit feed or less
+ * if that would drive a motor past its rate limit.
+ */
+struct vector_cost
+{
+	const char * name;
+	const char * unit;
+
+	// into the sort space, or NULL to sort the plot as it is
+	void (*map)(const vector_cost_t *, double x, double y, double * u, double * v);
+
+	// cost of a pen up move between two points in the sort space
+	double (*transit)(const vector_cost_t *, double u0, double v0, double u1, double v1);
+
+	// least cost of any move of d in the sort space, or NULL when the
+	// cost is the distance itself
+	double (*bound)(const vector_cost_t *, double d);
+
+	polar_t polar;
+	planner_t planner;
+	double offset_x;
+	double offset_y;
+	double transit_feed; // mm/min
+	double feed; // mm/min when drawing, for the --split estimates
+};
+
+
+static double
+vector_cost_distance(
+	const vector_cost_t * const cost,
+	const double u0,
+	const double v0,
+	const double u1,
+	const double v1
+)
+{
+	(void) cost;
+	return dist(u0, v0, u1, v1);
+}
+
+
+static void
+vector_cost_polar(
+	const vector_cost_t * const cost,
+	const double x,
+	const double y,
+	double * const u,
+	double * const v
+)
+{
+	polar_lengths(&cost->polar,
+		x + cost->offset_x,
+		y + cost->offset_y,
+		u, v);
+}
+
+
+static double
+vector_cost_time(
+	const vector_cost_t * const cost,
+	const double u0,
+	const double v0,
+	const double u1,
+	const double v1
+)
+{
+	return planner_move_time(&cost->planner,
+		u1 - u0, v1 - v0, cost->transit_feed / 60.0);
+}
+
+
+// a move is never faster than at the full transit feed
+static double
+vector_cost_time_bound(
+	const vector_cost_t * const cost,
+	const double d
+)
+{
+	return planner_trapezoid_time(&cost->planner,
+		d, 0, cost->transit_feed / 60.0, 0);
+}
+
+
+static const vector_cost_t vector_costs[] = {
+	{
+		.name = "distance",
+		.unit = "mm",
+		.transit = vector_cost_distance,
+	},
+	{
+		.name = "time",
+		.unit = "sec",
+		.map = vector_cost_polar,
+		.transit = vector_cost_time,
+		.bound = vector_cost_time_bound,
+	},
+};
+
+
+static const vector_cost_t *
+vector_cost_find(
+	const char * const name
+)
+{
+	for (size_t i = 0 ; i < sizeof(vector_costs) / sizeof(*vector_costs) ; i++)
+		if (strcmp(vector_costs[i].name, name) == 0)
+			return &vector_costs[i];
+
+	return NULL;
+}
+
+
+static inline void
+vector_cost_map(
+	const vector_cost_t * const cost,
+	const double x,
+	const double y,
+	double * const u,
+	double * const v
+)
+{
+	if (cost && cost->map)
+	{
+		cost->map(cost, x, y, u, v);
+	} else {
+		*u = x;
+		*v = y;
+	}
+}
+
+
+typedef struct
+{
+	double dist;
+	unsigned id;
+} vector_best_t;
+
+
+static inline void
+vector_best_update(
+	vector_best_t * const best,
+	const double dist,
+	const unsigned id
+)
+{
+	if (dist < best->dist || (dist == best->dist && id < best->id))
+	{
+		best->dist = dist;
+		best->id = id;
+	}
+}
+
+
+/** Nearest point kernels.
+ *
+ * Each one scans n points and folds the closest into *best, with the
+ * same lowest-id tie break as the scalar loop.  The distances are
+ * computed with separate multiplies and adds so that every kernel
+ * produces bit-identical results and therefore the same sort order.
+ *
+ * The kernel is chosen once at startup: AVX2 when the x86 cpu has
+ * it, NEON on 64-bit ARM (where it is always present; 32-bit NEON
+ * has no double precision lanes), and the scalar loop otherwise.
+ */
+typedef void (*vector_scan_fn)(
+	const double * x,
+	const double * y,
+	const unsigned * id,
+	unsigned n,
+	double cx,
+	double cy,
+	vector_best_t * best
+);
+
+static void
+vector_scan_scalar(
+	const double * const x,
+	const double * const y,
+	const unsigned * const id,
+	const unsigned n,
+	const double cx,
+	const double cy,
+	vector_best_t * const best
+)
+{
+	for (unsigned i = 0 ; i < n ; i++)
+	{
+		const double dx = cx - x[i];
+		const double dy = cy - y[i];
+		vector_best_update(best, dx*dx + dy*dy, id[i]);
+	}
+}
+
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static void
+vector_scan_avx2(
+	const double * const x,
+	const double * const y,
+	const unsigned * const id,
+	const unsigned n,
+	const double cx,
+	const double cy,
+	vector_best_t * const best
+)
+{
+	const __m256d vcx = _mm256_set1_pd(cx);
+	const __m256d vcy = _mm256_set1_pd(cy);
+	__m256d bd = _mm256_set1_pd(best->dist);
+	__m256d bi = _mm256_set1_pd(best->id);
+	unsigned i = 0;
+
+	// ids are less than 2^31, so the signed conversion is exact
+	for ( ; i + 4 <= n ; i += 4)
+	{
+		const __m256d dx = _mm256_sub_pd(vcx, _mm256_loadu_pd(&x[i]));
+		const __m256d dy = _mm256_sub_pd(vcy, _mm256_loadu_pd(&y[i]));
+		const __m256d d = _mm256_add_pd(
+			_mm256_mul_pd(dx, dx),
+			_mm256_mul_pd(dy, dy)
+		);
+		const __m256d ids = _mm256_cvtepi32_pd(
+			_mm_loadu_si128((const __m128i *) &id[i])
+		);
+
+		const __m256d better = _mm256_or_pd(
+			_mm256_cmp_pd(d, bd, _CMP_LT_OQ),
+			_mm256_and_pd(
+				_mm256_cmp_pd(d, bd, _CMP_EQ_OQ),
+				_mm256_cmp_pd(ids, bi, _CMP_LT_OQ)
+			)
+		);
+
+		bd = _mm256_blendv_pd(bd, d, better);
+		bi = _mm256_blendv_pd(bi, ids, better);
+	}
+
+	double lane_d[4], lane_i[4];
+	_mm256_storeu_pd(lane_d, bd);
+	_mm256_storeu_pd(lane_i, bi);
+
+	// avoid the AVX to SSE transition penalty in the caller
+	_mm256_zeroupper();
+
+	for (int j = 0 ; j < 4 ; j++)
+		vector_best_update(best, lane_d[j], (unsigned) lane_i[j]);
+
+	for ( ; i < n ; i++)
+	{
+		const double dx = cx - x[i];
+		const double dy = cy - y[i];
+		vector_best_update(best, dx*dx + dy*dy, id[i]);
+	}
+}
+#endif
+
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+
+static void
+vector_scan_neon(
+	const double * const x,
+	const double * const y,
+	const unsigned * const id,
+	const unsigned n,
+	const double cx,
+	const double cy,
+	vector_best_t * const best
+)
+{
+	const float64x2_t vcx = vdupq_n_f64(cx);
+	const float64x2_t vcy = vdupq_n_f64(cy);
+	float64x2_t bd[2] = { vdupq_n_f64(best->dist), vdupq_n_f64(best->dist) };
+	float64x2_t bi[2] = { vdupq_n_f64(best->id), vdupq_n_f64(best->id) };
+	unsigned i = 0;
+
+	for ( ; i + 4 <= n ; i += 4)
+	{
+		for (int k = 0 ; k < 2 ; k++)
+		{
+			const unsigned j = i + k * 2;
+			const float64x2_t dx = vsubq_f64(vcx, vld1q_f64(&x[j]));
+			const float64x2_t dy = vsubq_f64(vcy, vld1q_f64(&y[j]));
+			const float64x2_t d = vaddq_f64(
+				vmulq_f64(dx, dx),
+				vmulq_f64(dy, dy)
+			);
+			const float64x2_t ids = vcvtq_f64_u64(
+				vmovl_u32(vld1_u32(&id[j]))
+			);
+
+			const uint64x2_t better = vorrq_u64(
+				vcltq_f64(d, bd[k]),
+				vandq_u64(
+					vceqq_f64(d, bd[k]),
+					vcltq_f64(ids, bi[k])
+				)
+			);
+
+			bd[k] = vbslq_f64(better, d, bd[k]);
+			bi[k] = vbslq_f64(better, ids, bi[k]);
+		}
+	}
+
+	for (int k = 0 ; k < 2 ; k++)
+	{
+		vector_best_update(best, vgetq_lane_f64(bd[k], 0), (unsigned) vgetq_lane_f64(bi[k], 0));
+		vector_best_update(best, vgetq_lane_f64(bd[k], 1), (unsigned) vgetq_lane_f64(bi[k], 1));
+	}
+
+	vector_scan_scalar(&x[i], &y[i], &id[i], n - i, cx, cy, best);
+}
+#endif
+
+
+static vector_scan_fn vector_scan = vector_scan_scalar;
+static const char * vector_scan_name = "scalar";
+
+static void
+vector_scan_select(void)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (__builtin_cpu_supports("avx2"))
+	{
+		vector_scan = vector_scan_avx2;
+		vector_scan_name = "avx2";
+	}
+#elif defined(__aarch64__)
+	vector_scan = vector_scan_neon;
+	vector_scan_name = "neon";
+#endif
+}
+
+
+static inline void
+vector_index_scan_cell(
+	const vector_index_t * const idx,
+	const int c,
+	const double cx,
+	const double cy,
+	vector_best_t * const best
+)
+{
+	const unsigned base = idx->cell_start[c];
+	const unsigned n = idx->cell_len[c];
+
+	// not worth the indirect call for a nearly empty cell
+	if (n < 8)
+		vector_scan_scalar(&idx->px[base], &idx->py[base], &idx->pid[base], n, cx, cy, best);
+	else
+		vector_scan(&idx->px[base], &idx->py[base], &idx->pid[base], n, cx, cy, best);
+}
+
+
+/** Fold n points into *best by the cost of the move from cx,cy, for
+ * an index with a cost model rather than the distance kernels.
+ */
+static void
+vector_index_scan_cost(
+	const vector_index_t * const idx,
+	const unsigned base,
+	const unsigned n,
+	const double cx,
+	const double cy,
+	vector_best_t * const best
+)
+{
+	const vector_cost_t * const cost = idx->cost;
+
+	for (unsigned i = base ; i < base + n ; i++)
+	{
+		// the vacated slots are at infinity
+		if (!isfinite(idx->px[i]))
+			continue;
+
+		vector_best_update(best,
+			cost->transit(cost, cx, cy, idx->px[i], idx->py[i]),
+			idx->pid[i]);
+	}
+}
+
+
+/** Find the closest endpoint to cx,cy, or with a cost model the one
+ * that is cheapest to move to.
+ *
+ * Points inside the grid are found with a ring search that stops
+ * once the unvisited rings are provably further away than the best
+ * point so far.  Points outside of the grid (the start of a pass)
+ * fall back to a single kernel scan of the entire point array,
+ * which happens at most once per pass.
+ */
+static int
+vector_index_closest(
+	vector_index_t * const idx,
+	const double cx,
+	const double cy,
+	vector_best_t * const best
+)
+{
+	best->dist = idx->cost ? INFINITY : 1e9;
+	best->id = -1;
+
+	if (cx < idx->min_x || cx > idx->max_x
+	||  cy < idx->min_y || cy > idx->max_y)
+	{
+		const unsigned n = idx->cell_start[idx->cols * idx->rows];
+		if (idx->cost)
+			vector_index_scan_cost(idx, 0, n, cx, cy, best);
+		else
+			vector_scan(idx->px, idx->py, idx->pid, n, cx, cy, best);
+		idx->visits += idx->cols * idx->rows;
+		return best->id != (unsigned) -1;
+	}
+
+	const int home = vector_index_cell(idx, cx, cy);
+	const int qx = home % idx->cols;
+	const int qy = home / idx->cols;
+	const double slack = idx->cell * 1e-9;
+
+	for (int k = 0 ; ; k++)
+	{
+		const int x0 = qx - k, x1 = qx + k;
+		const int y0 = qy - k, y1 = qy + k;
+
+		for (int y = y0 ; y <= y1 ; y++)
+		{
+			if (y < 0 || y >= idx->rows)
+				continue;
+
+			// Only the edges of the ring for the middle rows
+			const int step = (y == y0 || y == y1) ? 1 : x1 - x0;
+			for (int x = x0 ; x <= x1 ; x += step ? step : 1)
+			{
+				if (x < 0 || x >= idx->cols)
+					continue;
+
+				const int c = y * idx->cols + x;
+				if (idx->cost)
+					vector_index_scan_cost(idx,
+						idx->cell_start[c], idx->cell_len[c],
+						cx, cy, best);
+				else
+					vector_index_scan_cell(idx, c, cx, cy, best);
+				idx->visits++;
+			}
+		}
+
+		// How far away is the nearest cell that has not been
+		// visited?  Edges against the grid boundary don't count.
+		double bound = 1e300;
+		if (x0 > 0)
+			bound = fmin(bound, cx - (idx->min_x + x0 * idx->cell));
+		if (x1 < idx->cols - 1)
+			bound = fmin(bound, idx->min_x + (x1+1) * idx->cell - cx);
+		if (y0 > 0)
+			bound = fmin(bound, cy - (idx->min_y + y0 * idx->cell));
+		if (y1 < idx->rows - 1)
+			bound = fmin(bound, idx->min_y + (y1+1) * idx->cell - cy);
+
+		if (bound == 1e300)
+			break;
+
+		// with a cost model, by the least that a move of that far
+		// could cost; otherwise the kernels give squared distances
+		bound -= slack;
+		if (bound > 0 && best->dist < (idx->cost
+			? idx->cost->bound(idx->cost, bound)
+			: bound * bound))
+			break;
+	}
+
+	return best->id != (unsigned) -1;
+}
+
+
+/** Find up to k of the closest endpoints to x,y that do not belong
+ * to the vector skip, nearest first.  Returns the number found.
+ *
+ * This is the same ring search as vector_index_closest(), but keeps
+ * a small insertion sorted list and only stops once the list is full
+ * and its furthest entry is closer than any unvisited ring.
+ */
+static unsigned
+vector_index_nearest(
+	const vector_index_t * const idx,
+	const double x,
+	const double y,
+	const unsigned skip,
+	const unsigned k,
+	vector_best_t * const out
+)
+{
+	unsigned found = 0;
+	const int home = vector_index_cell(idx, x, y);
+	const int qx = home % idx->cols;
+	const int qy = home / idx->cols;
+	const int max_ring = idx->cols > idx->rows ? idx->cols : idx->rows;
+
+	for (int r = 0 ; r <= max_ring ; r++)
+	{
+		for (int cy = qy - r ; cy <= qy + r ; cy++)
+		{
+			if (cy < 0 || cy >= idx->rows)
+				continue;
+
+			const int step = (cy == qy - r || cy == qy + r) ? 1 : 2 * r;
+			for (int cx = qx - r ; cx <= qx + r ; cx += step ? step : 1)
+			{
+				if (cx < 0 || cx >= idx->cols)
+					continue;
+
+				const int c = cy * idx->cols + cx;
+				const unsigned base = idx->cell_start[c];
+				for (unsigned i = base ; i < base + idx->cell_len[c] ; i++)
+				{
+					if (idx->pid[i] / 2 == skip)
+						continue;
+
+					const double dx = x - idx->px[i];
+					const double dy = y - idx->py[i];
+					const vector_best_t cand = { dx*dx + dy*dy, idx->pid[i] };
+
+					if (found == k && !(cand.dist < out[k-1].dist))
+						continue;
+
+					unsigned j = found < k ? found++ : k - 1;
+					while (j > 0 && cand.dist < out[j-1].dist)
+					{
+						out[j] = out[j-1];
+						j--;
+					}
+					out[j] = cand;
+				}
+			}
+		}
+
+		// the nearest unvisited cell is at least r cells away
+		const double bound = r * idx->cell;
+		if (found == k && out[k-1].dist < bound * bound)
+			break;
+	}
+
+	return found;
+}
+
+
+/** Find the closest vector to a given point and remove it from the index.
+ *
+ * Returns its position relative to the start of the indexed range,
+ * or -1 if there is nothing close.  *reverse is set if it is closest
+ * to draw it in reverse order.
+ */
+static int
+vector_find_closest(
+	vector_index_t * const idx,
+	const double cx,
+	const double cy,
+	unsigned * const reverse
+)
+{
+	vector_best_t best;
+	if (!vector_index_closest(idx, cx, cy, &best))
+		return -1;
+
+	vector_index_remove(idx, best.id / 2);
+	*reverse = best.id % 2;
+
+	return best.id / 2;
+}
+
+
+/**
+ * Optimize the cut order to minimize transit time.
+ *
+ * Simplistic greedy algorithm: look for the closest vector that starts
+ * or ends at the same point as the current point. 
+ *
+ * The endpoints are held in a uniform grid so that each step is a
+ * local search rather than a walk of the entire remaining list.
+ * The segments from first to the end of the pass are sorted in place,
+ * and the segments that were reversed and the grid cells searched are
+ * added to counts.  With a cost model that has a bound, the pass is in
+ * its sort space and the moves are ranked by its cost.
+ *
+ * This does not split vectors.
+ */
+static void
+vector_optimize(
+	vectors_t * const vs,
+	const unsigned first,
+	double *cx_ptr,
+	double *cy_ptr,
+	const vector_cost_t * const cost,
+	vector_counts_t * const counts
+)
+{
+	double cx = *cx_ptr;
+	double cy = *cy_ptr;
+
+	if (first >= vs->count)
+		return;
+
+	const unsigned n = vs->count - first;
+	double * const sorted = malloc(n * 4 * sizeof(*sorted));
+	unsigned * const tags = vs->tag ? malloc(n * sizeof(*tags)) : NULL;
+	if (!sorted || (vs->tag && !tags))
+	{
+		fprintf(stderr, "vectors: out of memory\n");
+		exit(-1);
+	}
+
+	vector_index_t idx;
+	vector_index_init(&idx, vs, first);
+	if (cost && cost->bound)
+		idx.cost = cost;
+
+	for (unsigned k = 0 ; idx.live ; k++)
+	{
+		unsigned reverse;
+		const int seq = vector_find_closest(&idx, cx, cy, &reverse);
+		if (seq < 0)
+		{
+			fprintf(stderr, "nothing close?\n");
+			abort();
+		}
+
+		// If reversing is required, flip the x1/x2 and y1/y2
+		const unsigned i = first + seq;
+		if (reverse)
+		{
+			sorted[0*n + k] = vs->x2[i];
+			sorted[1*n + k] = vs->y2[i];
+			sorted[2*n + k] = vs->x1[i];
+			sorted[3*n + k] = vs->y1[i];
+		} else {
+			sorted[0*n + k] = vs->x1[i];
+			sorted[1*n + k] = vs->y1[i];
+			sorted[2*n + k] = vs->x2[i];
+			sorted[3*n + k] = vs->y2[i];
+		}
+
+		if (tags)
+			tags[k] = vs->tag[i] ^ reverse;
+		counts->reversals += reverse;
+
+		// Move the current point to the end of the line segment
+		cx = sorted[2*n + k];
+		cy = sorted[3*n + k];
+	}
+
+	counts->visits += idx.visits;
+	vector_index_free(&idx);
+
+	if (tags)
+	{
+		memcpy(&vs->tag[first], tags, n * sizeof(*tags));
+		free(tags);
+	}
+
+	memcpy(&vs->x1[first], &sorted[0*n], n * sizeof(*sorted));
+	memcpy(&vs->y1[first], &sorted[1*n], n * sizeof(*sorted));
+	memcpy(&vs->x2[first], &sorted[2*n], n * sizeof(*sorted));
+	memcpy(&vs->y2[first], &sorted[3*n], n * sizeof(*sorted));
+	free(sorted);
+
+	//vector_stats(vs);
+	*cx_ptr = cx;
+	*cy_ptr = cy;
+}
+
+
+/** Local search refinement of a sorted pass.
+ *
+ * The greedy sort leaves long transits where it painted itself into
+ * a corner.  This improves the order with two kinds of moves:
+ *
+ * - 2-opt: reverse a run of segments (flipping each one), which
+ *   replaces the two transits at its ends with two new ones.
+ * - Or-opt: lift a chain of one to three segments out and reinsert
+ *   it, either way around, in another gap.
+ *
+ * Only gaps next to a segment's spatial neighbours are tried, using
+ * neighbour lists built from the endpoint grid, so each sweep over
+ * the pass is linear rather than quadratic.  Moves are applied as
+ * soon as they shorten the transit and sweeps repeat until nothing
+ * improves or the time or sweep budget runs out.
+ *
+ * Gap g is the transit into position g; gap 0 starts from sx,sy and
+ * gap n (after the last segment) is free.
+ */
+#define VECTOR_NEIGHBOURS 6
+#define VECTOR_OROPT_MAX 3
+#define VECTOR_REFINE_SPAN 50000
+
+typedef struct
+{
+	double time;
+	unsigned sweeps;
+	int two_opt_only;
+} vector_refine_budget_t;
+
+
+/** Set by the first SIGINT during a refinement, which then stops and
+ * keeps the best order so far: every move that was applied shortened
+ * the transit, so the order is always complete and no worse than the
+ * greedy one.  The flag stays set, so the rest of the passes and
+ * tiles are only sorted greedily and the job is still written out in
+ * full.  A second SIGINT kills the sort as usual.
+ */
+static volatile sig_atomic_t vector_interrupted;
+
+static void
+vector_interrupt(
+	const int sig
+)
+{
+	static const char msg[] = "Interrupted: finishing without any more refinement, ^C again to abort\n";
+
+	vector_interrupted = 1;
+	signal(sig, SIG_DFL);
+
+	// stdio is not safe in a signal handler
+	if (write(STDERR_FILENO, msg, sizeof(msg) - 1) < 0)
+		return;
+}
+
+typedef struct
+{
+	vectors_t * vs;
+	const vector_cost_t * cost; // to weigh the moves by, or NULL
+	unsigned n;
+	double sx;
+	double sy;
+	unsigned * id;
+	unsigned * pos;
+	unsigned * nbr;
+	unsigned * nbr_count;
+	unsigned two_opt;
+	unsigned or_opt;
+} vector_refine_t;
+
+
+// cost of the pen up move from x0,y0 to x1,y1
+static inline double
+vector_refine_move(
+	const vector_refine_t * const r,
+	const double x0,
+	const double y0,
+	const double x1,
+	const double y1
+)
+{
+	return r->cost
+		? r->cost->transit(r->cost, x0, y0, x1, y1)
+		: dist(x0, y0, x1, y1);
+}
+
+
+// end point of the segment at position p, or the start for p == -1
+static inline void
+vector_refine_end(
+	const vector_refine_t * const r,
+	const int p,
+	double * const x,
+	double * const y
+)
+{
+	if (p < 0)
+	{
+		*x = r->sx;
+		*y = r->sy;
+	} else {
+		*x = r->vs->x2[p];
+		*y = r->vs->y2[p];
+	}
+}
+
+
+// transit from x,y into gap g; the gap after the last segment is free
+static inline double
+vector_refine_join(
+	const vector_refine_t * const r,
+	const double x,
+	const double y,
+	const unsigned g
+)
+{
+	if (g >= r->n)
+		return 0;
+	return vector_refine_move(r, x, y, r->vs->x1[g], r->vs->y1[g]);
+}
+
+
+static inline double
+vector_refine_gap(
+	const vector_refine_t * const r,
+	const unsigned g
+)
+{
+	double x, y;
+	vector_refine_end(r, (int) g - 1, &x, &y);
+	return vector_refine_join(r, x, y, g);
+}
+
+
+static inline void
+vector_refine_put(
+	vector_refine_t * const r,
+	const unsigned p,
+	const unsigned id,
+	const unsigned tag,
+	const double x1,
+	const double y1,
+	const double x2,
+	const double y2
+)
+{
+	vectors_t * const vs = r->vs;
+	vs->x1[p] = x1;
+	vs->y1[p] = y1;
+	vs->x2[p] = x2;
+	vs->y2[p] = y2;
+	if (vs->tag)
+		vs->tag[p] = tag;
+	r->id[p] = id;
+	r->pos[id] = p;
+}
+
+
+static inline unsigned
+vector_tag(
+	const vectors_t * const vs,
+	const unsigned p
+)
+{
+	return vs->tag ? vs->tag[p] : 0;
+}
+
+
+/** Try reversing the segments between gaps g1 and g2. */
+static int
+vector_refine_2opt(
+	vector_refine_t * const r,
+	unsigned g1,
+	unsigned g2
+)
+{
+	if (g1 > g2)
+	{
+		const unsigned t = g1; g1 = g2; g2 = t;
+	}
+
+	if (g1 == g2 || g2 - g1 > VECTOR_REFINE_SPAN)
+		return 0;
+
+	vectors_t * const vs = r->vs;
+	double bx, by;
+	vector_refine_end(r, (int) g1 - 1, &bx, &by);
+
+	const unsigned last = g2 - 1;
+	const double delta
+		= vector_refine_move(r, bx, by, vs->x2[last], vs->y2[last])
+		+ vector_refine_join(r, vs->x1[g1], vs->y1[g1], g2)
+		- vector_refine_gap(r, g1)
+		- vector_refine_gap(r, g2);
+
+	if (!(delta < -1e-7))
+		return 0;
+
+	// by count, as j would wrap below a reversal that starts at 0
+	for (unsigned k = 0 ; k < (g2 - g1 + 1) / 2 ; k++)
+	{
+		const unsigned i = g1 + k, j = last - k;
+		const unsigned id_i = r->id[i], id_j = r->id[j];
+		const unsigned tag_i = vector_tag(vs, i), tag_j = vector_tag(vs, j);
+		const double ix1 = vs->x1[i], iy1 = vs->y1[i];
+		const double ix2 = vs->x2[i], iy2 = vs->y2[i];
+		vector_refine_put(r, i, id_j, tag_j ^ 1, vs->x2[j], vs->y2[j], vs->x1[j], vs->y1[j]);
+		if (i != j)
+			vector_refine_put(r, j, id_i, tag_i ^ 1, ix2, iy2, ix1, iy1);
+	}
+
+	r->two_opt++;
+	return 1;
+}
+
+
+/** Try moving the chain of len segments at position k into gap g,
+ * in whichever direction is cheaper.
+ */
+static int
+vector_refine_oropt(
+	vector_refine_t * const r,
+	const unsigned k,
+	const unsigned len,
+	const unsigned g
+)
+{
+	vectors_t * const vs = r->vs;
+	const unsigned end = k + len;
+
+	if (end > r->n || (g >= k && g <= end) || g > r->n)
+		return 0;
+	if ((g > k ? g - k : k - g) > VECTOR_REFINE_SPAN)
+		return 0;
+
+	double bx, by;
+	vector_refine_end(r, (int) k - 1, &bx, &by);
+	const double removed
+		= vector_refine_gap(r, k)
+		+ vector_refine_gap(r, end)
+		- vector_refine_join(r, bx, by, end);
+
+	double px, py;
+	vector_refine_end(r, (int) g - 1, &px, &py);
+	const double old_gap = vector_refine_gap(r, g);
+
+	const double fwd = vector_refine_move(r, px, py, vs->x1[k], vs->y1[k])
+		+ vector_refine_join(r, vs->x2[end-1], vs->y2[end-1], g)
+		- old_gap;
+	const double rev = vector_refine_move(r, px, py, vs->x2[end-1], vs->y2[end-1])
+		+ vector_refine_join(r, vs->x1[k], vs->y1[k], g)
+		- old_gap;
+
+	const int reverse = rev < fwd;
+	const double delta = (reverse ? rev : fwd) - removed;
+	if (!(delta < -1e-7))
+		return 0;
+
+	// lift the chain out
+	double chain[VECTOR_OROPT_MAX][4];
+	unsigned chain_id[VECTOR_OROPT_MAX];
+	unsigned chain_tag[VECTOR_OROPT_MAX];
+	for (unsigned i = 0 ; i < len ; i++)
+	{
+		const unsigned src = reverse ? end - 1 - i : k + i;
+		chain_id[i] = r->id[src];
+		chain_tag[i] = vector_tag(vs, src) ^ reverse;
+		if (reverse)
+		{
+			chain[i][0] = vs->x2[src]; chain[i][1] = vs->y2[src];
+			chain[i][2] = vs->x1[src]; chain[i][3] = vs->y1[src];
+		} else {
+			chain[i][0] = vs->x1[src]; chain[i][1] = vs->y1[src];
+			chain[i][2] = vs->x2[src]; chain[i][3] = vs->y2[src];
+		}
+	}
+
+	// shift the segments in between over the hole
+	unsigned dest;
+	if (g < k)
+	{
+		for (unsigned i = k ; i-- > g ; )
+			vector_refine_put(r, i + len, r->id[i], vector_tag(vs, i),
+				vs->x1[i], vs->y1[i], vs->x2[i], vs->y2[i]);
+		dest = g;
+	} else {
+		for (unsigned i = end ; i < g ; i++)
+			vector_refine_put(r, i - len, r->id[i], vector_tag(vs, i),
+				vs->x1[i], vs->y1[i], vs->x2[i], vs->y2[i]);
+		dest = g - len;
+	}
+
+	for (unsigned i = 0 ; i < len ; i++)
+		vector_refine_put(r, dest + i, chain_id[i], chain_tag[i],
+			chain[i][0], chain[i][1], chain[i][2], chain[i][3]);
+
+	r->or_opt++;
+	return 1;
+}
+
+
+/** Build the neighbour lists: the vectors owning the nearest few
+ * endpoints to each end of every vector.
+ */
+static void
+vector_refine_neighbours(
+	vector_refine_t * const r
+)
+{
+	vector_index_t idx;
+	vector_index_init(&idx, r->vs, 0);
+
+	for (unsigned p = 0 ; p < r->n ; p++)
+	{
+		vector_best_t near[VECTOR_NEIGHBOURS];
+		unsigned * const list = &r->nbr[p * VECTOR_NEIGHBOURS * 2];
+		unsigned count = 0;
+
+		for (int e = 0 ; e < 2 ; e++)
+		{
+			const double x = e ? r->vs->x2[p] : r->vs->x1[p];
+			const double y = e ? r->vs->y2[p] : r->vs->y1[p];
+			const unsigned found = vector_index_nearest(&idx, x, y, p, VECTOR_NEIGHBOURS, near);
+
+			for (unsigned i = 0 ; i < found ; i++)
+			{
+				const unsigned q = near[i].id / 2;
+				unsigned j = 0;
+				while (j < count && list[j] != q)
+					j++;
+				if (j == count)
+					list[count++] = q;
+			}
+		}
+
+		r->nbr_count[p] = count;
+	}
+
+	vector_index_free(&idx);
+}
+
+
+/** Total pen up cost of the pass, by the same measure as the moves. */
+static double
+vector_refine_total(
+	const vector_refine_t * const r
+)
+{
+	double total = 0;
+	for (unsigned g = 0 ; g < r->n ; g++)
+		total += vector_refine_gap(r, g);
+	return total;
+}
+
+
+/** Refine the order of a sorted pass that started from sx,sy.  With a
+ * cost model that has a bound, the pass is in its sort space and the
+ * moves are weighed by its cost.  Returns 0 if the refinement was cut
+ * short by the time budget or a SIGINT, so that the order depends on
+ * how fast it ran, or 1 if it ran out of sweeps or moves.
+ */
+static int
+vector_refine(
+	vectors_t * const vs,
+	const double sx,
+	const double sy,
+	const vector_cost_t * const cost,
+	const vector_refine_budget_t * const budget
+)
+{
+	const unsigned n = vs->count;
+	if (n < 2)
+		return 1;
+	if (vector_interrupted)
+	{
+		fprintf(stderr, "Refine: skipped (interrupted)\n");
+		return 0;
+	}
+
+	const double start = monotime();
+	vector_refine_t r = {
+		.vs = vs,
+		.cost = cost && cost->bound ? cost : NULL,
+		.n = n,
+		.sx = sx,
+		.sy = sy,
+		.id = malloc(n * sizeof(*r.id)),
+		.pos = malloc(n * sizeof(*r.pos)),
+		.nbr = malloc(n * VECTOR_NEIGHBOURS * 2 * sizeof(*r.nbr)),
+		.nbr_count = malloc(n * sizeof(*r.nbr_count)),
+	};
+	if (!r.id || !r.pos || !r.nbr || !r.nbr_count)
+	{
+		fprintf(stderr, "refine: out of memory\n");
+		exit(-1);
+	}
+
+	// ids are the positions in the greedy order
+	for (unsigned p = 0 ; p < n ; p++)
+		r.id[p] = r.pos[p] = p;
+
+	vector_refine_neighbours(&r);
+
+	const double initial = vector_refine_total(&r);
+
+	unsigned sweep = 0;
+	int improved = 1;
+	int out_of_time = 0;
+
+	while (improved && !out_of_time)
+	{
+		if (budget->sweeps && sweep >= budget->sweeps)
+			break;
+		sweep++;
+		improved = 0;
+
+		for (unsigned id = 0 ; id < n && !out_of_time ; id++)
+		{
+			if ((id & 1023) == 0
+			&&  (vector_interrupted
+			  || (budget->time && monotime() - start > budget->time)))
+				out_of_time = 1;
+
+			const unsigned * const list = &r.nbr[id * VECTOR_NEIGHBOURS * 2];
+			for (unsigned i = 0 ; i < r.nbr_count[id] ; i++)
+			{
+				const unsigned p = r.pos[id];
+				const unsigned q = r.pos[list[i]];
+
+				// join the ends of p and q, or the starts
+				if (vector_refine_2opt(&r, p + 1, q + 1)
+				||  vector_refine_2opt(&r, p, q))
+				{
+					improved = 1;
+					continue;
+				}
+
+				// move a chain starting at p next to q
+				for (unsigned len = 1 ; len <= VECTOR_OROPT_MAX && !budget->two_opt_only ; len++)
+				{
+					if (vector_refine_oropt(&r, p, len, q)
+					||  vector_refine_oropt(&r, p, len, q + 1))
+					{
+						improved = 1;
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	const double transit = vector_refine_total(&r);
+
+	fprintf(stderr, "Refine: %.3f sec %u sweeps %u 2-opt %u or-opt transit %.0f -> %.0f %s%s\n",
+		monotime() - start,
+		sweep,
+		r.two_opt,
+		r.or_opt,
+		initial,
+		transit,
+		r.cost ? r.cost->unit : "mm",
+		vector_interrupted ? " (interrupted)" : ""
+	);
+
+	// the regions of --split are refined on several threads
+	pthread_mutex_lock(&vector_profile_lock);
+	vector_profile.refine += monotime() - start;
+	vector_profile.two_opt += r.two_opt;
+	vector_profile.or_opt += r.or_opt;
+	pthread_mutex_unlock(&vector_profile_lock);
+
+	free(r.id);
+	free(r.pos);
+	free(r.nbr);
+	free(r.nbr_count);
+
+	return !out_of_time;
+}
+
+
+/** Polyline chaining.
+ *
+ * The input splits every path into two point segments, even though
+ * most of them are drawn end to end.  Chaining joins segments that
+ * share an endpoint (within fpeq()) back into polylines, so that the
+ * sort only has to order the polylines and the pen stays down along
+ * each of them.
+ *
+ * The endpoints are gathered into nodes with a snapped point hash, as
+ * in the duplicate check.  Each chain is grown backwards and then
+ * forwards from its seed segment, at every node taking the first
+ * unused segment that touches it, with seeds taken in input order.
+ *
+ * Each chain is handed to the optimizer as a pseudo-segment from its
+ * first point to its last, tagged with its index, so that the greedy
+ * sort and the refinement move and reverse whole polylines.  The pass
+ * is then expanded back out in the chosen order.
+ */
+typedef struct
+{
+	vectors_t chains;
+	unsigned * start;
+	unsigned count;
+	unsigned segments; // in the pass before it was simplified
+} vector_chains_t;
+
+typedef struct
+{
+	double x;
+	double y;
+} vector_node_t;
+
+
+static void *
+vector_chain_alloc(
+	const size_t count,
+	const size_t size
+)
+{
+	void * const p = calloc(count + 1, size);
+	if (!p)
+	{
+		fprintf(stderr, "chain: out of memory\n");
+		exit(-1);
+	}
+	return p;
+}
+
+
+/** Find the node within fpeq() of x,y, or -1 if there is none. */
+static int
+vector_node_find(
+	const vector_hash_t * const hash,
+	const vector_node_t * const nodes,
+	const double x,
+	const double y
+)
+{
+	if (!hash->size)
+		return -1;
+
+	const int64_t lx = vector_hash_snap(x - VECTOR_HASH_SLOP);
+	const int64_t hx = vector_hash_snap(x + VECTOR_HASH_SLOP);
+	const int64_t ly = vector_hash_snap(y - VECTOR_HASH_SLOP);
+	const int64_t hy = vector_hash_snap(y + VECTOR_HASH_SLOP);
+
+	for (int64_t ax = lx ; ax <= hx ; ax++)
+	for (int64_t ay = ly ; ay <= hy ; ay++)
+	{
+		const uint64_t key = vector_hash_key(ax, ay, ax, ay);
+
+		for (size_t i = key & (hash->size - 1)
+		;    hash->table[i].id
+		;    i = (i + 1) & (hash->size - 1))
+		{
+			if (hash->table[i].key != key)
+				continue;
+
+			const unsigned n = hash->table[i].id - 1;
+			if (fpeq(nodes[n].x, x) && fpeq(nodes[n].y, y))
+				return n;
+		}
+	}
+
+	return -1;
+}
+
+
+/** The next unused segment end at a node, or -1 if there is none. */
+static inline int
+vector_chain_next(
+	const unsigned * const inc,
+	const unsigned * const inc_end,
+	unsigned * const cursor,
+	const unsigned char * const used,
+	const unsigned node
+)
+{
+	while (cursor[node] < inc_end[node])
+	{
+		const unsigned e = inc[cursor[node]];
+		if (!used[e / 2])
+			return e;
+		cursor[node]++;
+	}
+
+	return -1;
+}
+
+
+/** Store the segments in order[] (index * 2 + reversed) into vs. */
+static void
+vector_chain_permute(
+	vectors_t * const vs,
+	const unsigned * const order
+)
+{
+	const unsigned n = vs->count;
+	double * const sorted = vector_chain_alloc(n * 4, sizeof(*sorted));
+
+	for (unsigned k = 0 ; k < n ; k++)
+	{
+		const unsigned i = order[k] / 2;
+		const int rev = order[k] & 1;
+		sorted[0*n + k] = rev ? vs->x2[i] : vs->x1[i];
+		sorted[1*n + k] = rev ? vs->y2[i] : vs->y1[i];
+		sorted[2*n + k] = rev ? vs->x1[i] : vs->x2[i];
+		sorted[3*n + k] = rev ? vs->y1[i] : vs->y2[i];
+	}
+
+	memcpy(vs->x1, &sorted[0*n], n * sizeof(*sorted));
+	memcpy(vs->y1, &sorted[1*n], n * sizeof(*sorted));
+	memcpy(vs->x2, &sorted[2*n], n * sizeof(*sorted));
+	memcpy(vs->y2, &sorted[3*n], n * sizeof(*sorted));
+	free(sorted);
+}
+
+
+/** Reorder the pass into chains, each one stored contiguously and
+ * facing forwards, and build the pseudo-segments for the sort.
+ */
+static void
+vector_chain_build(
+	vectors_t * const vs,
+	vector_chains_t * const ch
+)
+{
+	const unsigned n = vs->count;
+	const unsigned npoints = n * 2;
+
+	// gather the endpoints into nodes
+	vector_hash_t hash = { 0 };
+	vector_node_t * const nodes = vector_chain_alloc(npoints, sizeof(*nodes));
+	unsigned * const node_of = vector_chain_alloc(npoints, sizeof(*node_of));
+	unsigned nnodes = 0;
+
+	for (unsigned e = 0 ; e < npoints ; e++)
+	{
+		const unsigned i = e / 2;
+		const double x = (e & 1) ? vs->x2[i] : vs->x1[i];
+		const double y = (e & 1) ? vs->y2[i] : vs->y1[i];
+
+		int node = vector_node_find(&hash, nodes, x, y);
+		if (node < 0)
+		{
+			node = nnodes++;
+			nodes[node] = (vector_node_t){ x, y };
+			const int64_t ax = vector_hash_snap(x);
+			const int64_t ay = vector_hash_snap(y);
+			vector_hash_insert(&hash, vector_hash_key(ax, ay, ax, ay), node + 1);
+		}
+
+		node_of[e] = node;
+	}
+
+	free(hash.table);
+	free(nodes);
+
+	// the segment ends at each node, in input order
+	unsigned * const inc_start = vector_chain_alloc(nnodes + 1, sizeof(*inc_start));
+	unsigned * const inc_end = &inc_start[1];
+	unsigned * const cursor = vector_chain_alloc(nnodes, sizeof(*cursor));
+	unsigned * const inc = vector_chain_alloc(npoints, sizeof(*inc));
+
+	for (unsigned e = 0 ; e < npoints ; e++)
+		inc_start[node_of[e] + 1]++;
+	for (unsigned k = 0 ; k < nnodes ; k++)
+		inc_start[k+1] += inc_start[k];
+	memcpy(cursor, inc_start, nnodes * sizeof(*cursor));
+	for (unsigned e = 0 ; e < npoints ; e++)
+		inc[cursor[node_of[e]]++] = e;
+	memcpy(cursor, inc_start, nnodes * sizeof(*cursor));
+
+	// walk the chains; back[] holds the backwards extension of the
+	// current chain, which is written out in reverse
+	unsigned char * const used = vector_chain_alloc(n, sizeof(*used));
+	unsigned * const order = vector_chain_alloc(n, sizeof(*order));
+	unsigned * const back = vector_chain_alloc(n, sizeof(*back));
+	ch->start = vector_chain_alloc(n + 1, sizeof(*ch->start));
+	ch->count = 0;
+
+	unsigned out = 0;
+	for (unsigned seed = 0 ; seed < n ; seed++)
+	{
+		if (used[seed])
+			continue;
+
+		used[seed] = 1;
+		ch->start[ch->count++] = out;
+
+		unsigned nback = 0;
+		unsigned node = node_of[seed * 2 + 0];
+		int e;
+		while ((e = vector_chain_next(inc, inc_end, cursor, used, node)) >= 0)
+		{
+			// a segment that ends here runs forwards into the chain
+			const unsigned t = e / 2;
+			used[t] = 1;
+			back[nback++] = t * 2 + !(e & 1);
+			node = node_of[t * 2 + !(e & 1)];
+		}
+
+		while (nback)
+			order[out++] = back[--nback];
+
+		order[out++] = seed * 2;
+
+		node = node_of[seed * 2 + 1];
+		while ((e = vector_chain_next(inc, inc_end, cursor, used, node)) >= 0)
+		{
+			// a segment that starts here runs forwards out of it
+			const unsigned t = e / 2;
+			used[t] = 1;
+			order[out++] = t * 2 + (e & 1);
+			node = node_of[t * 2 + !(e & 1)];
+		}
+	}
+
+	ch->start[ch->count] = out;
+
+	free(used);
+	free(back);
+	free(inc);
+	free(inc_start);
+	free(cursor);
+	free(node_of);
+
+	vector_chain_permute(vs, order);
+	free(order);
+
+	vectors_t * const cv = &ch->chains;
+	memset(cv, 0, sizeof(*cv));
+	vector_grow(cv, ch->count + 1);
+	cv->tag = vector_chain_alloc(ch->count, sizeof(*cv->tag));
+	cv->count = ch->count;
+
+	for (unsigned c = 0 ; c < ch->count ; c++)
+	{
+		const unsigned first = ch->start[c];
+		const unsigned last = ch->start[c+1] - 1;
+		cv->x1[c] = vs->x1[first];
+		cv->y1[c] = vs->y1[first];
+		cv->x2[c] = vs->x2[last];
+		cv->y2[c] = vs->y2[last];
+		cv->tag[c] = c * 2;
+	}
+}
+
+
+/** Squared distance from x,y to the segment from x1,y1 to x2,y2. */
+static inline double
+vector_seg_dist2(
+	const double x,
+	const double y,
+	const double x1,
+	const double y1,
+	const double x2,
+	const double y2
+)
+{
+	const double dx = x2 - x1;
+	const double dy = y2 - y1;
+	const double len2 = dx*dx + dy*dy;
+
+	double t = len2 > 0 ? ((x - x1) * dx + (y - y1) * dy) / len2 : 0;
+	if (t < 0) t = 0;
+	if (t > 1) t = 1;
+
+	const double ex = x1 + t * dx - x;
+	const double ey = y1 + t * dy - y;
+	return ex*ex + ey*ey;
+}
+
+
+/** Simplify each chain with Douglas-Peucker.
+ *
+ * PDF curves are flattened into long runs of tiny, nearly collinear
+ * segments.  Each chain keeps its two ends and then, recursively, the
+ * point furthest from the segment between the points kept on either
+ * side, for as long as that is more than tolerance mm away, so the
+ * simplified chain stays within tolerance of the original.  The pass
+ * is compacted in place and the chains' pseudo-segments, which only
+ * depend on the ends, are unchanged.
+ */
+static void
+vector_chain_simplify(
+	vectors_t * const vs,
+	vector_chains_t * const ch,
+	const double tolerance
+)
+{
+	unsigned longest = 0;
+	for (unsigned c = 0 ; c < ch->count ; c++)
+		if (ch->start[c+1] - ch->start[c] > longest)
+			longest = ch->start[c+1] - ch->start[c];
+
+	double * const px = vector_chain_alloc(longest + 1, sizeof(*px));
+	double * const py = vector_chain_alloc(longest + 1, sizeof(*py));
+	unsigned char * const keep = vector_chain_alloc(longest + 1, sizeof(*keep));
+	unsigned * const stack = vector_chain_alloc(2 * (longest + 1), sizeof(*stack));
+	const double tol2 = tolerance * tolerance;
+
+	ch->segments = vs->count;
+	unsigned out = 0;
+
+	for (unsigned c = 0 ; c < ch->count ; c++)
+	{
+		// copied out first, since the compacted chain may overlap it
+		const unsigned first = ch->start[c];
+		const unsigned m = ch->start[c+1] - first;
+		for (unsigned k = 0 ; k < m ; k++)
+		{
+			px[k] = vs->x1[first + k];
+			py[k] = vs->y1[first + k];
+		}
+		px[m] = vs->x2[first + m - 1];
+		py[m] = vs->y2[first + m - 1];
+		const unsigned tag = vector_tag(vs, first);
+
+		memset(keep, 0, m + 1);
+		keep[0] = keep[m] = 1;
+
+		unsigned sp = 0;
+		stack[sp++] = 0;
+		stack[sp++] = m;
+
+		while (sp)
+		{
+			const unsigned b = stack[--sp];
+			const unsigned a = stack[--sp];
+
+			double worst = tol2;
+			unsigned split = 0;
+			for (unsigned k = a + 1 ; k < b ; k++)
+			{
+				const double d = vector_seg_dist2(px[k], py[k],
+					px[a], py[a], px[b], py[b]);
+				if (d > worst)
+				{
+					worst = d;
+					split = k;
+				}
+			}
+
+			if (!split)
+				continue;
+
+			keep[split] = 1;
+			stack[sp++] = a;
+			stack[sp++] = split;
+			stack[sp++] = split;
+			stack[sp++] = b;
+		}
+
+		ch->start[c] = out;
+		for (unsigned k = 1, prev = 0 ; k <= m ; k++)
+		{
+			if (!keep[k])
+				continue;
+
+			vs->x1[out] = px[prev];
+			vs->y1[out] = py[prev];
+			vs->x2[out] = px[k];
+			vs->y2[out] = py[k];
+			if (vs->tag)
+				vs->tag[out] = tag;
+			out++;
+			prev = k;
+		}
+	}
+
+	ch->start[ch->count] = out;
+	vs->count = out;
+
+	free(px);
+	free(py);
+	free(keep);
+	free(stack);
+}
+
+
+/** Lay the pass back out in the order the chains were sorted into,
+ * and release the chains.
+ */
+static void
+vector_chain_expand(
+	vectors_t * const vs,
+	vector_chains_t * const ch
+)
+{
+	const vectors_t * const cv = &ch->chains;
+	unsigned * const order = vector_chain_alloc(vs->count, sizeof(*order));
+	unsigned k = 0;
+
+	for (unsigned j = 0 ; j < cv->count ; j++)
+	{
+		const unsigned c = cv->tag[j] / 2;
+		const unsigned rev = cv->tag[j] & 1;
+		const unsigned first = ch->start[c];
+		const unsigned last = ch->start[c+1] - 1;
+
+		for (unsigned m = first ; m <= last ; m++)
+			order[k++] = (rev ? first + last - m : m) * 2 + rev;
+	}
+
+	vector_chain_permute(vs, order);
+	free(order);
+
+	vectors_free(&ch->chains);
+	free(ch->start);
+	ch->start = NULL;
+	ch->count = 0;
+}
+
+
+/** Cost of all the pen up moves of the pass, starting from u,v in
+ * the sort space.
+ */
+static double
+vector_cost_total(
+	const vector_cost_t * const cost,
+	const vectors_t * const vs,
+	double u,
+	double v
+)
+{
+	double total = 0;
+	double lx = NAN, ly = NAN;
+
+	for (unsigned i = 0 ; i < vs->count ; i++)
+	{
+		double u1, v1;
+		vector_cost_map(cost, vs->x1[i], vs->y1[i], &u1, &v1);
+
+		if (!fpeq(vs->x1[i], lx) || !fpeq(vs->y1[i], ly))
+			total += cost->transit(cost, u, v, u1, v1);
+
+		lx = vs->x2[i];
+		ly = vs->y2[i];
+		vector_cost_map(cost, lx, ly, &u, &v);
+	}
+
+	return total;
+}
+
+
+/** Each segment as a chain of its own, so that the pass can be
+ * sorted in a mapped copy.
+ */
+static void
+vector_chain_single(
+	const vectors_t * const vs,
+	vector_chains_t * const ch
+)
+{
+	const unsigned n = vs->count;
+	vectors_t * const cv = &ch->chains;
+
+	memset(cv, 0, sizeof(*cv));
+	vector_grow(cv, n + 1);
+	cv->tag = vector_chain_alloc(n, sizeof(*cv->tag));
+	cv->count = n;
+	ch->start = vector_chain_alloc(n + 1, sizeof(*ch->start));
+	ch->count = n;
+
+	memcpy(cv->x1, vs->x1, n * sizeof(*cv->x1));
+	memcpy(cv->y1, vs->y1, n * sizeof(*cv->y1));
+	memcpy(cv->x2, vs->x2, n * sizeof(*cv->x2));
+	memcpy(cv->y2, vs->y2, n * sizeof(*cv->y2));
+
+	for (unsigned i = 0 ; i <= n ; i++)
+		ch->start[i] = i;
+	for (unsigned i = 0 ; i < n ; i++)
+		cv->tag[i] = i * 2;
+}
+
+
+/** Set up what the sort will actually order: the pass itself, its
+ * chains, or a copy of either mapped into the sort space.  The chains
+ * are simplified to within tolerance mm if it is set.  The result
+ * must be handed back to vector_sort_end() once it is sorted.
+ */
+static vectors_t *
+vector_sort_begin(
+	vectors_t * const vs,
+	const int chain,
+	const double tolerance,
+	const vector_cost_t * const cost,
+	vector_chains_t * const ch
+)
+{
+	const int mapped = cost && cost->map;
+
+	if (chain)
+	{
+		vector_chain_build(vs, ch);
+		if (tolerance > 0)
+			vector_chain_simplify(vs, ch, tolerance);
+	} else
+	if (mapped)
+		vector_chain_single(vs, ch);
+	else
+		return vs;
+
+	vectors_t * const cv = &ch->chains;
+	for (unsigned i = 0 ; mapped && i < cv->count ; i++)
+	{
+		vector_cost_map(cost, cv->x1[i], cv->y1[i], &cv->x1[i], &cv->y1[i]);
+		vector_cost_map(cost, cv->x2[i], cv->y2[i], &cv->x2[i], &cv->y2[i]);
+	}
+
+	return cv;
+}
+
+
+static void
+vector_sort_end(
+	vectors_t * const vs,
+	vectors_t * const sorted,
+	vector_chains_t * const ch
+)
+{
+	if (sorted != vs)
+		vector_chain_expand(vs, ch);
+}
+
+
+/** Buffered writer for the sorted output.
+ *
+ * Coordinates are formatted straight into a block buffer instead of
+ * through fprintf("%.3f").  The value is scaled to thousandths and
+ * rounded, which gives the same digits as printf except when the
+ * scaled value lies within the rounding error of a half; those, and
+ * anything too large or not finite, are handed to snprintf() so that
+ * the output stays byte for byte the same.
+ */
+#define VECTOR_WRITE_BUFFER (64 << 10)
+
+typedef struct
+{
+	FILE * file;
+	size_t len;
+	char buf[VECTOR_WRITE_BUFFER];
+} vector_writer_t;
+
+
+static void
+vector_write_flush(
+	vector_writer_t * const wr
+)
+{
+	if (wr->len)
+		fwrite(wr->buf, 1, wr->len, wr->file);
+	wr->len = 0;
+}
+
+
+static inline void
+vector_write_str(
+	vector_writer_t * const wr,
+	const char * const s,
+	const size_t len
+)
+{
+	if (wr->len + len > sizeof(wr->buf))
+		vector_write_flush(wr);
+	memcpy(wr->buf + wr->len, s, len);
+	wr->len += len;
+}
+
+
+/** Append x formatted as by "%.3f". */
+static inline void
+vector_write_fixed3(
+	vector_writer_t * const wr,
+	const double x
+)
+{
+	// sign, up to 16 digits, the point and the decimals
+	if (wr->len + 32 > sizeof(wr->buf))
+		vector_write_flush(wr);
+
+	char * p = wr->buf + wr->len;
+	const double scaled = fabs(x) * 1000;
+	const double frac = scaled - floor(scaled);
+
+	if (!(scaled < 1e15) || fabs(frac - 0.5) <= scaled * 1e-15 + 1e-9)
+	{
+		char tmp[512];
+		const int len = snprintf(tmp, sizeof(tmp), "%.3f", x);
+		vector_write_str(wr, tmp, len);
+		return;
+	}
+
+	uint64_t q = (uint64_t)(scaled + 0.5);
+	char digits[24];
+	int n = 0;
+
+	for (int i = 0 ; i < 3 || q ; i++)
+	{
+		digits[n++] = '0' + q % 10;
+		q /= 10;
+		if (i == 2)
+		{
+			digits[n++] = '.';
+			if (!q)
+				digits[n++] = '0';
+		}
+	}
+
+	if (signbit(x))
+		*p++ = '-';
+	while (n)
+		*p++ = digits[--n];
+
+	wr->len = p - wr->buf;
+}
+
+
+/** x in thousandths, rounded exactly as "%.3f" would, for the binary
+ * output, which holds the same values as the text.
+ */
+static inline int32_t
+vector_fixed3(
+	const double x
+)
+{
+	const double scaled = fabs(x) * 1000;
+	if (!(scaled < INT32_MAX))
+	{
+		fprintf(stderr, "binary: %g is out of range\n", x);
+		exit(-1);
+	}
+
+	int32_t q = scaled + 0.5;
+
+	const double frac = scaled - floor(scaled);
+	if (fabs(frac - 0.5) <= scaled * 1e-15 + 1e-9)
+	{
+		char tmp[32];
+		snprintf(tmp, sizeof(tmp), "%.3f", fabs(x));
+		q = atoi(tmp) * 1000 + atoi(strchr(tmp, '.') + 1);
+	}
+
+	return signbit(x) ? -q : q;
+}
+
+
+/** Output only ever happens on the main thread, so the writer and the
+ * state of the binary output are shared by all of the output_ calls.
+ */
+static vector_writer_t vector_out;
+
+static struct
+{
+	int header;
+	int layer; // a VECBIN_LAYER block is still to be written
+	int32_t color[3];
+} vector_out_bin;
+
+
+static inline void
+vector_write_u32(
+	vector_writer_t * const wr,
+	const uint32_t v
+)
+{
+	vector_write_str(wr, (const char *) &v, sizeof(v));
+}
+
+
+/** Start the output of a pass, with its P line. */
+static void
+output_layer(
+	FILE * const pjl_file,
+	const int pass,
+	const int binary
+)
+{
+	const int color[3] = {
+		pass == 0 ? 100 : 0,
+		pass == 1 ? 100 : 0,
+		pass == 2 ? 100 : 0,
+	};
+
+	if (!binary)
+	{
+		fprintf(pjl_file, "P %d %d %d\n", color[0], color[1], color[2]);
+		return;
+	}
+
+	if (!vector_out_bin.header)
+	{
+		vecbin_write_header(pjl_file);
+		vector_out_bin.header = 1;
+	}
+
+	vector_out_bin.layer = 1;
+	for (int i = 0 ; i < 3 ; i++)
+		vector_out_bin.color[i] = color[i];
+}
+
+
+static void
+output_layer_end(
+	FILE * const pjl_file,
+	const int binary
+)
+{
+	if (!binary)
+	{
+		fprintf(pjl_file, "\n\n\n");
+		return;
+	}
+
+	if (!vector_out_bin.layer)
+		return;
+
+	// an empty pass still has its P line
+	const vecbin_block_t blk = {
+		.color = {
+			vector_out_bin.color[0],
+			vector_out_bin.color[1],
+			vector_out_bin.color[2],
+		},
+		.flags = VECBIN_LAYER,
+	};
+	fwrite(&blk, sizeof(blk), 1, pjl_file);
+	vector_out_bin.layer = 0;
+}
+
+
+/** Write the vectors as one binary block, with the same paths as the
+ * text output: a new path wherever a vector does not start at the end
+ * of the one before.
+ */
+static void
+output_vector_bin(
+	FILE * const pjl_file,
+	const vectors_t * const vs,
+	double * const lx_ptr,
+	double * const ly_ptr
+)
+{
+	vector_writer_t * const wr = &vector_out;
+	wr->file = pjl_file;
+
+	if (!vs->count)
+		return;
+
+	const double lx = *lx_ptr;
+	const double ly = *ly_ptr;
+	const int cont = fpeq(vs->x1[0],lx) && fpeq(vs->y1[0],ly);
+
+	vecbin_block_t blk = {
+		.color = {
+			vector_out_bin.color[0],
+			vector_out_bin.color[1],
+			vector_out_bin.color[2],
+		},
+		.flags = (vector_out_bin.layer ? VECBIN_LAYER : 0)
+			| (cont ? VECBIN_CONTINUE : 0),
+		.paths = 1,
+		.points = cont ? 1 : 2,
+	};
+	vector_out_bin.layer = 0;
+
+	for (unsigned i = 1 ; i < vs->count ; i++)
+	{
+		if (!fpeq(vs->x1[i],vs->x2[i-1]) || !fpeq(vs->y1[i],vs->y2[i-1]))
+		{
+			blk.paths++;
+			blk.points++;
+		}
+		blk.points++;
+	}
+
+	vector_write_str(wr, (const char *) &blk, sizeof(blk));
+
+	// the length of each path
+	uint32_t n = cont ? 1 : 2;
+	for (unsigned i = 1 ; i < vs->count ; i++)
+	{
+		if (!fpeq(vs->x1[i],vs->x2[i-1]) || !fpeq(vs->y1[i],vs->y2[i-1]))
+		{
+			vector_write_u32(wr, n);
+			n = 1;
+		}
+		n++;
+	}
+	vector_write_u32(wr, n);
+
+	// and the points
+	for (unsigned i = 0 ; i < vs->count ; i++)
+	{
+		if (i == 0
+		? !cont
+		: !fpeq(vs->x1[i],vs->x2[i-1]) || !fpeq(vs->y1[i],vs->y2[i-1]))
+		{
+			vector_write_u32(wr, vector_fixed3(vs->x1[i]));
+			vector_write_u32(wr, vector_fixed3(vs->y1[i]));
+		}
+
+		vector_write_u32(wr, vector_fixed3(vs->x2[i]));
+		vector_write_u32(wr, vector_fixed3(vs->y2[i]));
+	}
+
+	vector_write_flush(wr);
+
+	*lx_ptr = vs->x2[vs->count - 1];
+	*ly_ptr = vs->y2[vs->count - 1];
+}
+
+
+static void
+output_vector_text(
+	FILE * const pjl_file,
+	const vectors_t * const vs,
+	double * const lx_ptr,
+	double * const ly_ptr
+)
+{
+	double lx = *lx_ptr;
+	double ly = *ly_ptr;
+
+	vector_writer_t * const wr = &vector_out;
+	wr->file = pjl_file;
+
+	for (unsigned i = 0 ; i < vs->count ; i++)
+	{
+		if (fpeq(vs->x1[i],lx) && fpeq(vs->y1[i],ly))
+		{
+			// This is the continuation of a line, so
+			// just add additional points
+			vector_write_str(wr, "L ", 2);
+		} else {
+			// Stop the laser; we need to transit
+			// and then start the laser as we go to
+			// the next point.  Note initial ";"
+			vector_write_str(wr, "\nM ", 3);
+			vector_write_fixed3(wr, vs->x1[i]);
+			vector_write_str(wr, " ", 1);
+			vector_write_fixed3(wr, vs->y1[i]);
+			vector_write_str(wr, "\nL ", 3);
+		}
+
+		vector_write_fixed3(wr, vs->x2[i]);
+		vector_write_str(wr, " ", 1);
+		vector_write_fixed3(wr, vs->y2[i]);
+		vector_write_str(wr, "\n", 1);
+
+		// Changing power on the fly is not supported for now
+		// \todo: Check v->power and adjust ZS, XR, etc
+
+		// Move to the next vector, updating our current point
+		lx = vs->x2[i];
+		ly = vs->y2[i];
+	}
+
+	vector_write_flush(wr);
+
+	*lx_ptr = lx;
+	*ly_ptr = ly;
+}
+
+
+static void
+output_vector(
+	FILE * const pjl_file,
+	const vectors_t * const vs,
+	double * const lx_ptr,
+	double * const ly_ptr,
+	const int binary
+)
+{
+	// the transit of the whole plot, across the passes and tiles
+	vector_profile.segments += vs->count;
+	vector_profile.transit += vector_transit_len(vs,
+		vector_profile.x, vector_profile.y);
+	if (vs->count)
+	{
+		vector_profile.x = vs->x2[vs->count - 1];
+		vector_profile.y = vs->y2[vs->count - 1];
+	}
+
+	const double start = monotime();
+	if (binary)
+		output_vector_bin(pjl_file, vs, lx_ptr, ly_ptr);
+	else
+		output_vector_text(pjl_file, vs, lx_ptr, ly_ptr);
+	vector_profile.emit += monotime() - start;
+}
+
+				
+/** Options for the in-memory sort. */
+typedef struct
+{
+	int threads;
+	int chain;
+	double tolerance; // mm to simplify the chains by, or 0
+	int binary;
+	const vector_cost_t * cost;
+	const vector_cost_t * machine; // the cost model for the --split estimates
+	vector_refine_budget_t refine;
+	const char * cache; // directory of sorted passes, or NULL
+	int schedule;
+	int marker[VECTOR_PASSES]; // passes that share a marker are merged
+	int split; // plotters to share the job between, or 0
+	const char * split_output; // file name for each one, with a %d
+} vector_opts_t;
+
+
+/** Parallel sort.
+ *
+ * With more than one thread each colour pass is sorted independently,
+ * starting from the origin rather than where the previous pass ended,
+ * and large passes are cut into a grid of spatial tiles.  The tiles
+ * are laid out in serpentine order and each one is greedily sorted
+ * from a start point fixed before any work begins: the centre of the
+ * previous tile clamped into this one.  Since no task depends on
+ * another, the result is the same however the threads are scheduled,
+ * and the tiles are simply concatenated in order to stitch the pass
+ * back together.
+ *
+ * The tasks are handed out largest first from a shared queue, so that
+ * idle workers keep taking work until the queue is empty.
+ */
+#define VECTOR_TILE_MIN 4096
+
+typedef struct
+{
+	int pass;
+	vectors_t view;
+	double x0;
+	double y0;
+	double x1;
+	double y1;
+	double sx;
+	double sy;
+	double time;
+	vector_counts_t counts;
+} vector_task_t;
+
+typedef struct
+{
+	vector_task_t ** tasks;
+	unsigned count;
+	unsigned next;
+	pthread_mutex_t lock;
+	const vector_cost_t * cost;
+} vector_pool_t;
+
+
+static void *
+vector_pool_worker(
+	void * const arg
+)
+{
+	vector_pool_t * const pool = arg;
+
+	while (1)
+	{
+		pthread_mutex_lock(&pool->lock);
+		const unsigned k = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (k >= pool->count)
+			break;
+
+		vector_task_t * const t = pool->tasks[k];
+		double cx = t->sx;
+		double cy = t->sy;
+
+		const double start = monotime();
+		vector_optimize(&t->view, 0, &cx, &cy, pool->cost, &t->counts);
+		t->time = monotime() - start;
+	}
+
+	return NULL;
+}
+
+
+static int
+vector_task_cmp(
+	const void * const a_ptr,
+	const void * const b_ptr
+)
+{
+	const vector_task_t * const a = *(vector_task_t * const *) a_ptr;
+	const vector_task_t * const b = *(vector_task_t * const *) b_ptr;
+
+	// largest first, then in task order
+	if (a->view.count != b->view.count)
+		return a->view.count > b->view.count ? -1 : 1;
+	return a < b ? -1 : a > b;
+}
+
+
+/** Reorder a pass into a serpentine grid of up to want tiles,
+ * keeping the original order within each tile, and fill in a task
+ * for each tile that is not empty.  Returns the number of tasks.
+ */
+static unsigned
+vector_tile_pass(
+	vectors_t * const vs,
+	const int pass,
+	const unsigned want,
+	vector_task_t * const tasks
+)
+{
+	const unsigned n = vs->count;
+	double min_x = 1e300, min_y = 1e300;
+	double max_x = -1e300, max_y = -1e300;
+
+	for (unsigned i = 0 ; i < n ; i++)
+	{
+		const double mx = (vs->x1[i] + vs->x2[i]) / 2;
+		const double my = (vs->y1[i] + vs->y2[i]) / 2;
+		if (mx < min_x) min_x = mx;
+		if (mx > max_x) max_x = mx;
+		if (my < min_y) min_y = my;
+		if (my > max_y) max_y = my;
+	}
+
+	const double w = fmax(max_x - min_x, 1e-6);
+	const double h = fmax(max_y - min_y, 1e-6);
+	unsigned cols = 1, rows = 1;
+
+	if (want > 1)
+	{
+		cols = sqrt(want * w / h) + 0.5;
+		if (cols < 1) cols = 1;
+		if (cols > want) cols = want;
+		rows = want / cols;
+		if (rows < 1) rows = 1;
+	}
+
+	const unsigned tiles = cols * rows;
+	unsigned * const tile = malloc((n + 1) * sizeof(*tile));
+	unsigned * const start = calloc(tiles + 1, sizeof(*start));
+	double * const sorted = malloc((n * 4 + 1) * sizeof(*sorted));
+	if (!tile || !start || !sorted)
+	{
+		fprintf(stderr, "vectors: out of memory\n");
+		exit(-1);
+	}
+
+	for (unsigned i = 0 ; i < n ; i++)
+	{
+		const double mx = (vs->x1[i] + vs->x2[i]) / 2;
+		const double my = (vs->y1[i] + vs->y2[i]) / 2;
+		unsigned c = (mx - min_x) / w * cols;
+		unsigned r = (my - min_y) / h * rows;
+		if (c >= cols) c = cols - 1;
+		if (r >= rows) r = rows - 1;
+
+		// odd rows run right to left
+		tile[i] = r * cols + ((r & 1) ? cols - 1 - c : c);
+		start[tile[i] + 1]++;
+	}
+
+	for (unsigned t = 0 ; t < tiles ; t++)
+		start[t+1] += start[t];
+
+	unsigned * const tags = vs->tag ? malloc((n + 1) * sizeof(*tags)) : NULL;
+	if (vs->tag && !tags)
+	{
+		fprintf(stderr, "vectors: out of memory\n");
+		exit(-1);
+	}
+
+	// stable counting sort of the segments into tile order
+	{
+		unsigned * const pos = malloc((tiles + 1) * sizeof(*pos));
+		if (!pos)
+		{
+			fprintf(stderr, "vectors: out of memory\n");
+			exit(-1);
+		}
+		memcpy(pos, start, tiles * sizeof(*pos));
+
+		for (unsigned i = 0 ; i < n ; i++)
+		{
+			const unsigned k = pos[tile[i]]++;
+			sorted[0*n + k] = vs->x1[i];
+			sorted[1*n + k] = vs->y1[i];
+			sorted[2*n + k] = vs->x2[i];
+			sorted[3*n + k] = vs->y2[i];
+			if (tags)
+				tags[k] = vs->tag[i];
+		}
+
+		free(pos);
+	}
+
+	if (tags)
+	{
+		memcpy(vs->tag, tags, n * sizeof(*tags));
+		free(tags);
+	}
+
+	memcpy(vs->x1, &sorted[0*n], n * sizeof(*sorted));
+	memcpy(vs->y1, &sorted[1*n], n * sizeof(*sorted));
+	memcpy(vs->x2, &sorted[2*n], n * sizeof(*sorted));
+	memcpy(vs->y2, &sorted[3*n], n * sizeof(*sorted));
+
+	unsigned count = 0;
+	for (unsigned t = 0 ; t < tiles ; t++)
+	{
+		if (start[t] == start[t+1])
+			continue;
+
+		const unsigned r = t / cols;
+		const unsigned c = (r & 1) ? cols - 1 - t % cols : t % cols;
+		vector_task_t * const task = &tasks[count];
+		const unsigned first = start[t];
+
+		task->pass = pass;
+		task->view = (vectors_t){
+			.x1 = &vs->x1[first],
+			.y1 = &vs->y1[first],
+			.x2 = &vs->x2[first],
+			.y2 = &vs->y2[first],
+			.tag = vs->tag ? &vs->tag[first] : NULL,
+			.count = start[t+1] - first,
+		};
+		task->x0 = min_x + c * w / cols;
+		task->x1 = min_x + (c + 1) * w / cols;
+		task->y0 = min_y + r * h / rows;
+		task->y1 = min_y + (r + 1) * h / rows;
+		task->time = 0;
+
+		if (count == 0)
+		{
+			task->sx = 0;
+			task->sy = 0;
+		} else {
+			const vector_task_t * const prev = &tasks[count-1];
+			task->sx = fmin(fmax((prev->x0 + prev->x1) / 2, task->x0), task->x1);
+			task->sy = fmin(fmax((prev->y0 + prev->y1) / 2, task->y0), task->y1);
+		}
+
+		count++;
+	}
+
+	free(tile);
+	free(start);
+	free(sorted);
+
+	return count;
+}
+
+
+static void
+vector_sort_parallel(
+	vectors_t * const * const passes,
+	const int threads,
+	const vector_cost_t * const cost,
+	double * const sort_time,
+	unsigned * const tiles
+)
+{
+	unsigned max_tasks = 0;
+	unsigned want[VECTOR_PASSES];
+
+	for (int i = 0 ; i < VECTOR_PASSES ; i++)
+	{
+		const unsigned n = passes[i]->count;
+		want[i] = n / VECTOR_TILE_MIN;
+		if (want[i] > (unsigned) threads * 4)
+			want[i] = threads * 4;
+		if (want[i] < 1)
+			want[i] = 1;
+		max_tasks += want[i];
+	}
+
+	vector_task_t * const tasks = calloc(max_tasks + 1, sizeof(*tasks));
+	vector_task_t ** const queue = calloc(max_tasks + 1, sizeof(*queue));
+	if (!tasks || !queue)
+	{
+		fprintf(stderr, "vectors: out of memory\n");
+		exit(-1);
+	}
+
+	unsigned count = 0;
+	for (int i = 0 ; i < VECTOR_PASSES ; i++)
+	{
+		if (!passes[i]->count)
+			continue;
+		tiles[i] = vector_tile_pass(passes[i], i, want[i], &tasks[count]);
+		count += tiles[i];
+	}
+
+	for (unsigned k = 0 ; k < count ; k++)
+		queue[k] = &tasks[k];
+	qsort(queue, count, sizeof(*queue), vector_task_cmp);
+
+	vector_pool_t pool = {
+		.tasks = queue,
+		.count = count,
+		.next = 0,
+		.cost = cost,
+	};
+	pthread_mutex_init(&pool.lock, NULL);
+
+	const int nthreads = (unsigned) threads < count ? threads : (int) count;
+	pthread_t * const tids = calloc(nthreads + 1, sizeof(*tids));
+	for (int t = 0 ; t < nthreads ; t++)
+	{
+		if (pthread_create(&tids[t], NULL, vector_pool_worker, &pool) != 0)
+		{
+			perror("pthread_create");
+			exit(-1);
+		}
+	}
+
+	for (int t = 0 ; t < nthreads ; t++)
+		pthread_join(tids[t], NULL);
+
+	pthread_mutex_destroy(&pool.lock);
+
+	for (unsigned k = 0 ; k < count ; k++)
+	{
+		sort_time[tasks[k].pass] += tasks[k].time;
+		vector_profile.counts.reversals += tasks[k].counts.reversals;
+		vector_profile.counts.visits += tasks[k].counts.visits;
+	}
+
+	free(tids);
+	free(queue);
+	free(tasks);
+}
+
+
+/** Cache of sorted passes.
+ *
+ * Each pass is keyed by a hash of its segments exactly as they were
+ * read, in order, along with every option that changes how it is
+ * sorted and the point that the sort starts from.  A pass that is the
+ * same as last time is then the same input to the same deterministic
+ * sort, so the sorted segments are simply read back from the file in
+ * the cache directory instead of being sorted again.  The time budget
+ * of the refinement is not deterministic, so it is not in the key and
+ * a pass is only saved if its refinement stopped for any other reason.
+ * A second hash with a different seed is stored in the file and
+ * checked, so that a collision in the name is not enough to reuse the
+ * wrong pass.
+ */
+#define VECTOR_CACHE_MAGIC 0x31435356 // "VSC1"
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t count;
+	uint64_t check;
+} vector_cache_header_t;
+
+
+static inline uint64_t
+vector_cache_mix(
+	uint64_t h,
+	const uint64_t v
+)
+{
+	h ^= v;
+	h *= 0x9e3779b97f4a7c15ULL;
+	return h ^ (h >> 32);
+}
+
+
+static inline uint64_t
+vector_cache_double(
+	const uint64_t h,
+	const double v
+)
+{
+	uint64_t bits;
+	memcpy(&bits, &v, sizeof(bits));
+	return vector_cache_mix(h, bits);
+}
+
+
+/** Hash of the segments of the pass, in their input order. */
+static uint64_t
+vector_cache_input(
+	const vectors_t * const vs,
+	const uint64_t seed
+)
+{
+	uint64_t h = vector_cache_mix(seed, vs->count);
+	const double * const arrays[] = { vs->x1, vs->y1, vs->x2, vs->y2 };
+
+	for (int j = 0 ; j < 4 ; j++)
+		for (unsigned i = 0 ; i < vs->count ; i++)
+			h = vector_cache_double(h, arrays[j][i]);
+
+	return h;
+}
+
+
+/** Combine the input hash with the options and the start point. */
+static uint64_t
+vector_cache_key(
+	uint64_t h,
+	const vector_opts_t * const opts,
+	const double sx,
+	const double sy
+)
+{
+	h = vector_cache_mix(h, opts->threads > 1 ? opts->threads : 1);
+	h = vector_cache_mix(h, opts->chain);
+	h = vector_cache_double(h, opts->tolerance);
+	h = vector_cache_mix(h, opts->refine.time > 0 || opts->refine.sweeps > 0);
+	h = vector_cache_mix(h, opts->refine.sweeps);
+	h = vector_cache_mix(h, opts->refine.two_opt_only);
+	h = vector_cache_double(h, sx);
+	h = vector_cache_double(h, sy);
+
+	const vector_cost_t * const cost = opts->cost;
+	if (cost)
+	{
+		for (const char * c = cost->name ; *c ; c++)
+			h = vector_cache_mix(h, *c);
+
+		const double params[] = {
+			cost->polar.width,
+			cost->polar.home_length,
+			cost->polar.steps_per_mm,
+			cost->offset_x,
+			cost->offset_y,
+			cost->transit_feed,
+			cost->planner.acceleration,
+			cost->planner.junction_deviation,
+			cost->planner.max_rate[0],
+			cost->planner.max_rate[1],
+		};
+		for (size_t i = 0 ; i < sizeof(params) / sizeof(*params) ; i++)
+			h = vector_cache_double(h, params[i]);
+	}
+
+	return h;
+}
+
+
+static void
+vector_cache_path(
+	char * const path,
+	const size_t size,
+	const char * const dir,
+	const uint64_t key
+)
+{
+	snprintf(path, size, "%s/%016llx.vsc", dir, (unsigned long long) key);
+}
+
+
+/** Replace the pass with the sorted one from the cache, if it is
+ * there.  Returns 1 if it was.
+ */
+static int
+vector_cache_load(
+	const char * const dir,
+	vectors_t * const vs,
+	const uint64_t key,
+	const uint64_t check
+)
+{
+	char path[4096];
+	vector_cache_path(path, sizeof(path), dir, key);
+
+	FILE * const f = fopen(path, "rb");
+	if (!f)
+		return 0;
+
+	// a pass simplified with --tolerance comes back shorter
+	vector_cache_header_t hdr;
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1
+	||  hdr.magic != VECTOR_CACHE_MAGIC
+	||  hdr.count > vs->count
+	||  hdr.check != check)
+	{
+		fclose(f);
+		return 0;
+	}
+
+	const unsigned n = hdr.count;
+	double * const sorted = vector_chain_alloc(n * 4 + 1, sizeof(*sorted));
+	const int ok = fread(sorted, sizeof(*sorted), n * 4, f) == n * 4;
+	fclose(f);
+
+	if (ok)
+	{
+		memcpy(vs->x1, &sorted[0*n], n * sizeof(*sorted));
+		memcpy(vs->y1, &sorted[1*n], n * sizeof(*sorted));
+		memcpy(vs->x2, &sorted[2*n], n * sizeof(*sorted));
+		memcpy(vs->y2, &sorted[3*n], n * sizeof(*sorted));
+		vs->count = n;
+	}
+
+	free(sorted);
+	return ok;
+}
+
+
+/** Save the sorted pass, writing it under a temporary name first so
+ * that an interrupted run never leaves a partial entry.
+ */
+static void
+vector_cache_save(
+	const char * const dir,
+	const vectors_t * const vs,
+	const uint64_t key,
+	const uint64_t check
+)
+{
+	char path[4096];
+	char tmp[4096 + 16];
+	vector_cache_path(path, sizeof(path), dir, key);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	FILE * const f = fopen(tmp, "wb");
+	if (!f)
+	{
+		perror(tmp);
+		return;
+	}
+
+	const vector_cache_header_t hdr = {
+		.magic = VECTOR_CACHE_MAGIC,
+		.count = vs->count,
+		.check = check,
+	};
+	const double * const arrays[] = { vs->x1, vs->y1, vs->x2, vs->y2 };
+
+	int ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+	for (int j = 0 ; j < 4 ; j++)
+		ok = ok && fwrite(arrays[j], sizeof(double), vs->count, f) == vs->count;
+
+	if (fclose(f) != 0 || !ok || rename(tmp, path) != 0)
+	{
+		perror(path);
+		remove(tmp);
+	}
+}
+
+
+/** Draw the pass backwards: the last segment first, from its end. */
+static void
+vector_reverse(
+	vectors_t * const vs
+)
+{
+	for (unsigned i = 0, j = vs->count - 1 ; i <= j && j < vs->count ; i++, j--)
+	{
+		const double x1 = vs->x1[i], y1 = vs->y1[i];
+		const double x2 = vs->x2[i], y2 = vs->y2[i];
+
+		vs->x1[i] = vs->x2[j];
+		vs->y1[i] = vs->y2[j];
+		vs->x2[i] = vs->x1[j];
+		vs->y2[i] = vs->y1[j];
+
+		vs->x1[j] = x2;
+		vs->y1[j] = y2;
+		vs->x2[j] = x1;
+		vs->y2[j] = y1;
+
+		if (vs->tag)
+		{
+			const unsigned t = vs->tag[i];
+			vs->tag[i] = vs->tag[j] ^ 1;
+			vs->tag[j] = t ^ 1;
+		}
+	}
+}
+
+
+/** Pick the order of the sorted passes, and which way round to draw
+ * each of them, for the least pen up travel between them.
+ *
+ * Only the two ends of each pass matter here: the moves within it are
+ * the same either way round.  With three passes there are only 6
+ * orders and 8 directions, so they are all tried, starting from the
+ * origin and going back to it at the end just as pjl2gcode does.
+ * Ties keep the order of the input.
+ *
+ * When every pass was sorted from the origin, as with -j, this is the
+ * whole of the travel that the schedule changes.  When each one
+ * carried on from the end of the one before, the ends only predict
+ * where a pass will start and finish once it is sorted again in the
+ * new order, which vector_schedule_sort() does.
+ */
+static void
+vector_schedule(
+	const vector_cost_t * cost,
+	vectors_t * const passes,
+	int * const order,
+	int * const reversed
+)
+{
+	static const int perms[6][VECTOR_PASSES] = {
+		{ 0, 1, 2 }, { 0, 2, 1 }, { 1, 0, 2 },
+		{ 1, 2, 0 }, { 2, 0, 1 }, { 2, 1, 0 },
+	};
+
+	if (!cost)
+		cost = vector_cost_find("distance");
+
+	// the two ends of each pass in the sort space
+	double ends[VECTOR_PASSES][4];
+	for (int i = 0 ; i < VECTOR_PASSES ; i++)
+	{
+		const vectors_t * const vs = &passes[i];
+		if (!vs->count)
+			continue;
+
+		vector_cost_map(cost, vs->x1[0], vs->y1[0],
+			&ends[i][0], &ends[i][1]);
+		vector_cost_map(cost, vs->x2[vs->count - 1], vs->y2[vs->count - 1],
+			&ends[i][2], &ends[i][3]);
+	}
+
+	double best = INFINITY;
+	for (int p = 0 ; p < 6 ; p++)
+	{
+		for (int mask = 0 ; mask < 1 << VECTOR_PASSES ; mask++)
+		{
+			double u = 0, v = 0;
+			double total = 0;
+			int wasted = 0;
+
+			for (int k = 0 ; k < VECTOR_PASSES ; k++)
+			{
+				const int i = perms[p][k];
+				const int rev = (mask >> i) & 1;
+				if (!passes[i].count)
+				{
+					// an empty pass has no direction to try
+					wasted |= rev;
+					continue;
+				}
+
+				const double * const e = ends[i];
+				total += cost->transit(cost, u, v,
+					e[rev ? 2 : 0], e[rev ? 3 : 1]);
+				u = e[rev ? 0 : 2];
+				v = e[rev ? 1 : 3];
+			}
+
+			if (wasted)
+				continue;
+
+			total += cost->transit(cost, u, v, 0, 0);
+			if (total >= best)
+				continue;
+
+			best = total;
+			for (int k = 0 ; k < VECTOR_PASSES ; k++)
+			{
+				order[k] = perms[p][k];
+				reversed[k] = (mask >> k) & 1;
+			}
+		}
+	}
+
+	fprintf(stderr, "Schedule:");
+	for (int k = 0 ; k < VECTOR_PASSES ; k++)
+		if (passes[order[k]].count)
+			fprintf(stderr, " %d%s", order[k], reversed[order[k]] ? "r" : "");
+	fprintf(stderr, " between passes %.0f %s\n", best, cost->unit);
+}
+
+
+/** Copy the segments of a pass as they are, to be sorted again. */
+static void
+vectors_copy(
+	vectors_t * const dst,
+	const vectors_t * const src
+)
+{
+	memset(dst, 0, sizeof(*dst));
+	if (!src->count)
+		return;
+
+	vector_grow(dst, src->count);
+	memcpy(dst->x1, src->x1, src->count * sizeof(*dst->x1));
+	memcpy(dst->y1, src->y1, src->count * sizeof(*dst->y1));
+	memcpy(dst->x2, src->x2, src->count * sizeof(*dst->x2));
+	memcpy(dst->y2, src->y2, src->count * sizeof(*dst->y2));
+	dst->count = src->count;
+}
+
+
+/** Pen up cost of plotting the passes in order, each carrying on from
+ * the end of the one before, from the origin and back to it.
+ */
+static double
+vector_plot_cost(
+	const vector_cost_t * const cost,
+	const vectors_t * const passes,
+	const int * const order
+)
+{
+	double u = 0, v = 0;
+	double total = 0;
+
+	for (int k = 0 ; k < VECTOR_PASSES ; k++)
+	{
+		const vectors_t * const vs = &passes[order[k]];
+		if (!vs->count)
+			continue;
+
+		total += vector_cost_total(cost, vs, u, v);
+		vector_cost_map(cost,
+			vs->x2[vs->count - 1], vs->y2[vs->count - 1],
+			&u, &v);
+	}
+
+	return total + cost->transit(cost, u, v, 0, 0);
+}
+
+
+/** Sort the passes as read in the order of the schedule, each from
+ * where the one before it ends, so that the greedy start also picks
+ * which way round it goes.
+ */
+static void
+vector_schedule_sort(
+	vectors_t * const passes,
+	const int * const order,
+	const vector_opts_t * const opts
+)
+{
+	const int refine = opts->refine.time > 0 || opts->refine.sweeps > 0;
+	double lx = 0, ly = 0;
+
+	for (int k = 0 ; k < VECTOR_PASSES ; k++)
+	{
+		vectors_t * const vs = &passes[order[k]];
+		if (!vs->count)
+			continue;
+
+		const double sx = lx, sy = ly;
+		vector_chains_t ch = { .count = 0 };
+		vectors_t * const sorted = vector_sort_begin(vs,
+			opts->chain, opts->tolerance, opts->cost, &ch);
+		vector_optimize(sorted, 0, &lx, &ly, opts->cost, &vector_profile.counts);
+		if (refine)
+			vector_refine(sorted, sx, sy, opts->cost, &opts->refine);
+		vector_sort_end(vs, sorted, &ch);
+
+		vector_cost_map(opts->cost,
+			vs->x2[vs->count - 1], vs->y2[vs->count - 1],
+			&lx, &ly);
+	}
+}
+
+
+static void
+generate_vectors(
+	FILE * const vector_file,
+	FILE * const pjl_file,
+	const vector_opts_t * const opts
+)
+{
+	const int threads = opts->threads;
+	const double parse_start = monotime();
+	vector_job_t * const job = vectors_parse(vector_file, opts->marker);
+	if (!job)
+		exit(-1);
+	vector_profile.parse = monotime() - parse_start;
+	const double sort_start = monotime();
+	vector_profile.transit_in = 0;
+
+	double lx = 0;
+	double ly = 0;
+
+	vector_stats_t before[VECTOR_PASSES] = {{ 0 }};
+	double sort_time[VECTOR_PASSES] = { 0 };
+	unsigned tiles[VECTOR_PASSES] = { 0 };
+	vector_chains_t chains[VECTOR_PASSES] = {{ .count = 0 }};
+	vectors_t * sort_vs[VECTOR_PASSES];
+	uint64_t input[VECTOR_PASSES][2] = {{ 0 }};
+	int cached[VECTOR_PASSES] = { 0 };
+	static vectors_t none;
+
+	// without -j the schedule sorts the passes again in its order,
+	// from the input rather than from the first sort
+	const int resort = opts->schedule && threads <= 1;
+	vectors_t input_vs[VECTOR_PASSES] = {{ 0 }};
+
+	// with chaining or a cost model the sort orders a copy instead
+	for (int i = 0 ; i < VECTOR_PASSES ; i++)
+	{
+		vector_stats_add(&before[i], &job->pass[i]);
+		vector_profile.transit_in += before[i].transit_len_sum;
+		sort_vs[i] = &job->pass[i];
+
+		if (!job->pass[i].count)
+			continue;
+
+		if (resort)
+			vectors_copy(&input_vs[i], &job->pass[i]);
+
+		if (opts->cache)
+		{
+			input[i][0] = vector_cache_input(&job->pass[i], 0);
+			input[i][1] = vector_cache_input(&job->pass[i], ~0ULL);
+		}
+
+		// the parallel sort starts every pass from the origin, so
+		// the cache can be checked before any of them are sorted;
+		// otherwise the start point is only known pass by pass
+		if (threads <= 1)
+			continue;
+
+		if (opts->cache)
+			cached[i] = vector_cache_load(opts->cache, &job->pass[i],
+				vector_cache_key(input[i][0], opts, 0, 0),
+				vector_cache_key(input[i][1], opts, 0, 0));
+
+		if (cached[i])
+			sort_vs[i] = &none;
+		else
+			sort_vs[i] = vector_sort_begin(&job->pass[i],
+				opts->chain, opts->tolerance, opts->cost, &chains[i]);
+	}
+
+	if (threads > 1)
+	{
+		const double start = monotime();
+		vector_sort_parallel(sort_vs, threads, opts->cost, sort_time, tiles);
+		vector_profile.optimise = monotime() - start;
+		fprintf(stderr, "Sorted with %d threads in %.3f sec\n",
+			threads, vector_profile.optimise);
+	}
+
+	for (int i = 0 ; i < VECTOR_PASSES ; i++)
+	{
+		vectors_t * const vs = &job->pass[i];
+		if (!vs->count)
+			continue;
+
+		fprintf(stderr, "Group %d\n", i);
+		vector_stats_print(&before[i]);
+
+		// the parallel sort starts every pass from the origin;
+		// lx,ly are in the sort space
+		double sx = threads > 1 ? 0 : lx;
+		double sy = threads > 1 ? 0 : ly;
+
+		const uint64_t key = vector_cache_key(input[i][0], opts, sx, sy);
+		const uint64_t check = vector_cache_key(input[i][1], opts, sx, sy);
+
+		// a cached pass skips the chaining and simplification too
+		if (threads <= 1)
+		{
+			cached[i] = opts->cache
+				&& vector_cache_load(opts->cache, vs, key, check);
+			if (!cached[i])
+				sort_vs[i] = vector_sort_begin(vs,
+					opts->chain, opts->tolerance, opts->cost, &chains[i]);
+		}
+
+		if (cached[i])
+		{
+			fprintf(stderr, "Sort: cached\n");
+			vector_stats(vs);
+		} else {
+			if (opts->chain)
+				fprintf(stderr, "Chains: %u\n", chains[i].count);
+			if (opts->tolerance > 0)
+				fprintf(stderr, "Simplified: %u -> %u segments\n",
+					chains[i].segments, vs->count);
+
+			if (threads <= 1)
+			{
+				const double start = monotime();
+				vector_optimize(sort_vs[i], 0, &lx, &ly, opts->cost, &vector_profile.counts);
+				sort_time[i] = monotime() - start;
+				vector_profile.optimise += sort_time[i];
+			} else
+			if (tiles[i] > 1)
+				fprintf(stderr, "Tiles: %u\n", tiles[i]);
+
+			fprintf(stderr, "Sort: %.3f sec\n", sort_time[i]);
+
+			const int refine = opts->refine.time > 0 || opts->refine.sweeps > 0;
+			const int copy = sort_vs[i] != vs;
+			int complete = 1;
+			if (!copy)
+				vector_stats(vs);
+			if (refine)
+				complete = vector_refine(sort_vs[i], sx, sy, opts->cost, &opts->refine);
+			vector_sort_end(vs, sort_vs[i], &chains[i]);
+			if (copy || refine)
+				vector_stats(vs);
+
+			// a refinement cut short is not what the key promises
+			if (opts->cache && complete)
+				vector_cache_save(opts->cache, vs, key, check);
+		}
+
+		if (opts->cost)
+			fprintf(stderr, "Transit: %.0f %s\n",
+				vector_cost_total(opts->cost, vs, sx, sy),
+				opts->cost->unit);
+
+		// the next pass continues from the new end point
+		vector_cost_map(opts->cost,
+			vs->x2[vs->count - 1], vs->y2[vs->count - 1],
+			&lx, &ly);
+	}
+
+	static const int in_order[VECTOR_PASSES] = { 0, 1, 2 };
+	int order[VECTOR_PASSES] = { 0, 1, 2 };
+	int reversed[VECTOR_PASSES] = { 0 };
+	vectors_t * passes = job->pass;
+	if (opts->schedule)
+		vector_schedule(opts->cost, job->pass, order, reversed);
+
+	// the passes carried on from each other, so the new order is
+	// only kept if sorting them again in it does better overall
+	if (resort && memcmp(order, in_order, sizeof(order)) != 0)
+	{
+		const vector_cost_t * const cost = opts->cost
+			? opts->cost : vector_cost_find("distance");
+
+		vector_schedule_sort(input_vs, order, opts);
+		const double was = vector_plot_cost(cost, job->pass, in_order);
+		const double now = vector_plot_cost(cost, input_vs, order);
+
+		fprintf(stderr, "Schedule: sorted again in order, transit %.0f -> %.0f %s%s\n",
+			was, now, cost->unit,
+			now < was ? "" : ", keeping the input order");
+
+		if (now < was)
+			passes = input_vs;
+		else
+			memcpy(order, in_order, sizeof(order));
+	}
+	if (resort)
+		memset(reversed, 0, sizeof(reversed));
+	vector_profile.sort = monotime() - sort_start;
+
+	for (int k = 0 ; k < VECTOR_PASSES ; k++)
+	{
+		const int i = order[k];
+		vectors_t * const vs = &passes[i];
+		if (!vs->count)
+			continue;
+
+		if (reversed[i])
+			vector_reverse(vs);
+
+		output_layer(pjl_file, i, opts->binary);
+		double ox = 0, oy = 0;
+		output_vector(pjl_file, vs, &ox, &oy, opts->binary);
+		output_layer_end(pjl_file, opts->binary);
+	}
+
+	for (int i = 0 ; i < VECTOR_PASSES ; i++)
+		vectors_free(&input_vs[i]);
+	vector_job_free(job);
+}
+
+
+/** Streaming mode.
+ *
+ * For inputs that do not fit in memory the canvas is cut into square
+ * tiles and each segment is spilled, in blocks, to a single temp file
+ * under the tile of its lower (x, then y) endpoint.  Since a segment
+ * and its reverse share that endpoint, all of the duplicates land in
+ * the same tile and are dropped when it is loaded.
+ *
+ * The tiles are visited in a serpentine order, rows of increasing y
+ * alternating direction, and each is sorted with the normal greedy
+ * optimizer starting from where the previous one finished.  A tile
+ * that holds more segments than the memory budget allows is split
+ * into four and its children visited the same way, so that the peak
+ * size is bounded by the budget rather than the input.
+ *
+ * Each tile that is being filled has a buffer of one block, and only
+ * a quarter of the budget is allowed for them; when that runs out all
+ * of the buffers are spilled, part full, and released.  The blocks of
+ * a tile are chained back through the temp file, so that a tile only
+ * holds the offset of its last one.
+ */
+#define VECTOR_STREAM_BLOCK 256
+
+// Rough resident cost of a loaded segment: storage, dedup hash,
+// grid index and the sort scratch space.
+#define VECTOR_STREAM_BYTES 256
+
+typedef struct
+{
+	double x1;
+	double y1;
+	double x2;
+	double y2;
+} vector_seg_t;
+
+// Ahead of the segments of each block in the temp file
+typedef struct
+{
+	off_t prev; // the tile's block before this one, or -1
+	uint32_t count;
+	uint32_t reserved;
+} vector_block_t;
+
+typedef struct
+{
+	int pass;
+	int level;
+	int64_t tx;
+	int64_t ty;
+	unsigned count;
+
+	off_t last; // the last block spilled, or -1
+	unsigned nblocks;
+
+	vector_seg_t * buf;
+	unsigned buffered;
+	unsigned slot; // in the stream's list of buffers
+} vector_tile_t;
+
+typedef struct
+{
+	FILE * spill;
+	double tile_size;
+	unsigned max_segments;
+
+	vector_tile_t * tiles;
+	unsigned count;
+	unsigned size;
+	vector_hash_t lookup;
+	unsigned splits;
+	unsigned seen[VECTOR_PASSES];
+	const int * marker;
+
+	unsigned * buffers; // the tiles that hold a buffer
+	unsigned nbuffers;
+	unsigned max_buffers;
+	unsigned flushes;
+} vector_stream_t;
+
+
+static inline uint64_t
+vector_tile_key(
+	int pass,
+	int64_t tx,
+	int64_t ty
+)
+{
+	// Pack exactly, then mix with a bijection so that distinct tiles
+	// never collide and neighbours spread out over the table.
+	uint64_t k = ((uint64_t) pass << 62)
+		^ (((uint64_t) tx & 0x7FFFFFFF) << 31)
+		^ ((uint64_t) ty & 0x7FFFFFFF);
+	k ^= k >> 30;
+	k *= 0xbf58476d1ce4e5b9ULL;
+	k ^= k >> 27;
+	k *= 0x94d049bb133111ebULL;
+	k ^= k >> 31;
+	return k;
+}
+
+
+static unsigned
+vector_tile_new(
+	vector_stream_t * const st,
+	const int pass,
+	const int level,
+	const int64_t tx,
+	const int64_t ty
+)
+{
+	if (st->count == st->size)
+	{
+		st->size = st->size ? st->size * 2 : 64;
+		st->tiles = realloc(st->tiles, st->size * sizeof(*st->tiles));
+		if (!st->tiles)
+		{
+			fprintf(stderr, "stream: out of memory\n");
+			exit(-1);
+		}
+	}
+
+	vector_tile_t * const t = &st->tiles[st->count];
+	memset(t, 0, sizeof(*t));
+	t->pass = pass;
+	t->level = level;
+	t->tx = tx;
+	t->ty = ty;
+	t->last = -1;
+
+	return st->count++;
+}
+
+
+/** Write out what is in the tile's buffer as a block of its own. */
+static void
+vector_tile_spill(
+	vector_stream_t * const st,
+	vector_tile_t * const t
+)
+{
+	if (!t->buffered)
+		return;
+
+	const vector_block_t blk = {
+		.prev = t->last,
+		.count = t->buffered,
+	};
+
+	if (fseeko(st->spill, 0, SEEK_END) < 0
+	||  (t->last = ftello(st->spill)) < 0
+	||  fwrite(&blk, sizeof(blk), 1, st->spill) != 1
+	||  fwrite(t->buf, sizeof(*t->buf), t->buffered, st->spill) != t->buffered)
+	{
+		perror("stream: spill write");
+		exit(-1);
+	}
+
+	t->nblocks++;
+	t->buffered = 0;
+}
+
+
+/** Take the tile's buffer off the list and free it, spilling it first
+ * if asked to.
+ */
+static void
+vector_tile_unbuffer(
+	vector_stream_t * const st,
+	const unsigned ti,
+	const int spill
+)
+{
+	vector_tile_t * const t = &st->tiles[ti];
+	if (!t->buf)
+		return;
+
+	if (spill)
+		vector_tile_spill(st, t);
+
+	const unsigned moved = st->buffers[--st->nbuffers];
+	st->buffers[t->slot] = moved;
+	st->tiles[moved].slot = t->slot;
+
+	free(t->buf);
+	t->buf = NULL;
+}
+
+
+static void
+vector_tile_add(
+	vector_stream_t * const st,
+	const unsigned ti,
+	const vector_seg_t * const seg
+)
+{
+	if (!st->tiles[ti].buf)
+	{
+		// out of room for buffers, so spill all of them
+		if (st->nbuffers == st->max_buffers)
+		{
+			while (st->nbuffers)
+				vector_tile_unbuffer(st, st->buffers[0], 1);
+			st->flushes++;
+		}
+
+		vector_tile_t * const t = &st->tiles[ti];
+		t->buf = malloc(VECTOR_STREAM_BLOCK * sizeof(*t->buf));
+		if (!t->buf)
+		{
+			fprintf(stderr, "stream: out of memory\n");
+			exit(-1);
+		}
+
+		t->slot = st->nbuffers;
+		st->buffers[st->nbuffers++] = ti;
+	}
+
+	vector_tile_t * const t = &st->tiles[ti];
+	t->buf[t->buffered++] = *seg;
+	t->count++;
+
+	if (t->buffered == VECTOR_STREAM_BLOCK)
+		vector_tile_spill(st, t);
+}
+
+
+/** Read back every segment in a tile, in the order they were added,
+ * and release the tile's buffers.
+ */
+static void
+vector_tile_drain(
+	vector_stream_t * const st,
+	const unsigned ti,
+	void (*fn)(void * arg, const vector_seg_t * seg),
+	void * const arg
+)
+{
+	// fn may add tiles and spill the buffers, so the tile's own is
+	// spilled and released first, and no pointer into the array held
+	vector_tile_unbuffer(st, ti, 1);
+
+	const unsigned nblocks = st->tiles[ti].nblocks;
+	off_t * const offsets = calloc(nblocks + 1, sizeof(*offsets));
+	vector_seg_t * const block = malloc(VECTOR_STREAM_BLOCK * sizeof(*block));
+	if (!offsets || !block)
+	{
+		fprintf(stderr, "stream: out of memory\n");
+		exit(-1);
+	}
+
+	// the chain runs backwards from the last block
+	vector_block_t blk = { .prev = st->tiles[ti].last };
+	for (unsigned b = nblocks ; b-- > 0 ; )
+	{
+		offsets[b] = blk.prev;
+		if (offsets[b] < 0
+		||  fseeko(st->spill, offsets[b], SEEK_SET) < 0
+		||  fread(&blk, sizeof(blk), 1, st->spill) != 1)
+		{
+			perror("stream: spill read");
+			exit(-1);
+		}
+	}
+
+	for (unsigned b = 0 ; b < nblocks ; b++)
+	{
+		if (fseeko(st->spill, offsets[b], SEEK_SET) < 0
+		||  fread(&blk, sizeof(blk), 1, st->spill) != 1
+		||  blk.count > VECTOR_STREAM_BLOCK
+		||  fread(block, sizeof(*block), blk.count, st->spill) != blk.count)
+		{
+			perror("stream: spill read");
+			exit(-1);
+		}
+
+		for (unsigned i = 0 ; i < blk.count ; i++)
+			fn(arg, &block[i]);
+	}
+
+	free(block);
+	free(offsets);
+
+	vector_tile_t * const t = &st->tiles[ti];
+	t->last = -1;
+	t->nblocks = 0;
+}
+
+
+static inline void
+vector_seg_anchor(
+	const vector_seg_t * const seg,
+	double * const x,
+	double * const y
+)
+{
+	if (seg->x2 < seg->x1 || (seg->x2 == seg->x1 && seg->y2 < seg->y1))
+	{
+		*x = seg->x2;
+		*y = seg->y2;
+	} else {
+		*x = seg->x1;
+		*y = seg->y1;
+	}
+}
+
+
+static void
+vector_stream_sink(
+	void * const arg,
+	const int in_pass,
+	const double x1,
+	const double y1,
+	const double x2,
+	const double y2
+)
+{
+	vector_stream_t * const st = arg;
+	const vector_seg_t seg = { x1, y1, x2, y2 };
+	const int pass = st->marker[in_pass];
+	double ax, ay;
+
+	// Zero length segments are only kept at the start of a pass,
+	// the same as vector_create() but for the pass instead of a tile
+	if (st->seen[pass]++ && fpeq(x1,x2) && fpeq(y1,y2))
+		return;
+
+	vector_seg_anchor(&seg, &ax, &ay);
+
+	const int64_t tx = floor(ax / st->tile_size);
+	const int64_t ty = floor(ay / st->tile_size);
+	const uint64_t key = vector_tile_key(pass, tx, ty);
+
+	// find the tile, or start a new one
+	unsigned ti = -1;
+	for (size_t i = st->lookup.size ? key & (st->lookup.size - 1) : 0
+	;    st->lookup.size && st->lookup.table[i].id
+	;    i = (i + 1) & (st->lookup.size - 1))
+	{
+		if (st->lookup.table[i].key != key)
+			continue;
+		ti = st->lookup.table[i].id - 1;
+		break;
+	}
+
+	if (ti == (unsigned) -1)
+	{
+		ti = vector_tile_new(st, pass, 0, tx, ty);
+		vector_hash_insert(&st->lookup, key, ti + 1);
+	}
+
+	vector_tile_add(st, ti, &seg);
+}
+
+
+typedef struct
+{
+	vector_stream_t * st;
+	unsigned first;
+	double size;
+	int64_t tx;
+	int64_t ty;
+} vector_split_t;
+
+
+static void
+vector_split_seg(
+	void * const arg,
+	const vector_seg_t * const seg
+)
+{
+	const vector_split_t * const sp = arg;
+	double ax, ay;
+	vector_seg_anchor(seg, &ax, &ay);
+
+	// clamp in case of rounding at the parent's edges
+	int64_t cx = (int64_t) floor(ax / sp->size) - sp->tx * 2;
+	int64_t cy = (int64_t) floor(ay / sp->size) - sp->ty * 2;
+	cx = cx < 0 ? 0 : cx > 1 ? 1 : cx;
+	cy = cy < 0 ? 0 : cy > 1 ? 1 : cy;
+
+	vector_tile_add(sp->st, sp->first + cy * 2 + cx, seg);
+}
+
+
+/** Replace an oversized tile with its four children, returning the
+ * index of the first.  They are numbered y*2+x within the parent.
+ */
+static unsigned
+vector_tile_split(
+	vector_stream_t * const st,
+	const unsigned ti
+)
+{
+	const vector_tile_t t = st->tiles[ti];
+	vector_split_t sp = {
+		.st = st,
+		.first = st->count,
+		.size = ldexp(st->tile_size, -(t.level + 1)),
+		.tx = t.tx,
+		.ty = t.ty,
+	};
+
+	for (int i = 0 ; i < 4 ; i++)
+		vector_tile_new(st, t.pass, t.level + 1, t.tx * 2 + (i & 1), t.ty * 2 + (i >> 1));
+
+	vector_tile_drain(st, ti, vector_split_seg, &sp);
+	st->splits++;
+
+	return sp.first;
+}
+
+
+static void
+vector_load_seg(
+	void * const arg,
+	const vector_seg_t * const seg
+)
+{
+	vector_create(arg, seg->x1, seg->y1, seg->x2, seg->y2);
+}
+
+
+typedef struct
+{
+	FILE * pjl_file;
+	double sx;
+	double sy;
+	double ox;
+	double oy;
+	int chain;
+	double tolerance;
+	int binary;
+	const vector_cost_t * cost;
+	double sort_time;
+	vector_stats_t stats;
+} vector_stream_out_t;
+
+
+/** Sort and emit one tile, or recurse into its children if it is
+ * too large for the memory budget.  dir is the direction of travel
+ * along the current row of tiles.
+ */
+static void
+vector_stream_tile(
+	vector_stream_t * const st,
+	const unsigned ti,
+	const int dir,
+	vector_stream_out_t * const out
+)
+{
+	if (!st->tiles[ti].count)
+		return;
+
+	if (st->tiles[ti].count > st->max_segments
+	&&  st->tiles[ti].level < 30)
+	{
+		// serpentine through the 2x2 children
+		static const int order[2][4] = {
+			{ 0, 1, 3, 2 },
+			{ 1, 0, 2, 3 },
+		};
+
+		const unsigned first = vector_tile_split(st, ti);
+		for (int i = 0 ; i < 4 ; i++)
+			vector_stream_tile(st, first + order[dir < 0][i], dir, out);
+		return;
+	}
+
+	vectors_t vs = { 0 };
+	vector_tile_drain(st, ti, vector_load_seg, &vs);
+
+	const double start = monotime();
+	vector_chains_t ch;
+	vectors_t * const sorted = vector_sort_begin(&vs, out->chain, out->tolerance, out->cost, &ch);
+	vector_optimize(sorted, 0, &out->sx, &out->sy, out->cost, &vector_profile.counts);
+	vector_sort_end(&vs, sorted, &ch);
+	out->sort_time += monotime() - start;
+
+	vector_stats_add(&out->stats, &vs);
+	output_vector(out->pjl_file, &vs, &out->ox, &out->oy, out->binary);
+
+	vectors_free(&vs);
+}
+
+
+static const vector_stream_t * vector_stream_sorting;
+
+static int
+vector_tile_cmp(
+	const void * const a_ptr,
+	const void * const b_ptr
+)
+{
+	const vector_tile_t * const a = &vector_stream_sorting->tiles[*(const unsigned *) a_ptr];
+	const vector_tile_t * const b = &vector_stream_sorting->tiles[*(const unsigned *) b_ptr];
+
+	if (a->ty != b->ty)
+		return a->ty < b->ty ? -1 : 1;
+
+	// odd rows run right to left
+	const int dir = (a->ty & 1) ? -1 : 1;
+	if (a->tx != b->tx)
+		return a->tx < b->tx ? -dir : dir;
+
+	return 0;
+}
+
 
-		double transit_len = sqrt(t_dx * t_dx + t_dy * t_dy);
-		if (!fpeq(transit_len, 0) && max_transit < transit_len)
-		{
-			max_transit = transit_len;
-			transit_v = v;
-		}
+static void
+generate_vectors_stream(
+	FILE * const vector_file,
+	FILE * const pjl_file,
+	const double tile_size,
+	const double memory_mb,
+	const vector_opts_t * const opts
+)
+{
+	vector_stream_t st = {
+		.spill = tmpfile(),
+		.tile_size = tile_size,
+		.max_segments = memory_mb * 1024 * 1024 * 3 / 4 / VECTOR_STREAM_BYTES,
+		.max_buffers = memory_mb * 1024 * 1024 / 4
+			/ (VECTOR_STREAM_BLOCK * sizeof(vector_seg_t)),
+		.marker = opts->marker,
+	};
 
-		// Advance the point
-		cx = v->x2;
-		cy = v->y2;
-		v = v->next;
+	if (st.max_segments < VECTOR_STREAM_BLOCK)
+		st.max_segments = VECTOR_STREAM_BLOCK;
+	if (st.max_buffers < 4)
+		st.max_buffers = 4;
+
+	if (!st.spill)
+	{
+		perror("stream: tmpfile");
+		exit(-1);
 	}
 
-	if (!transit_v)
+	st.buffers = calloc(st.max_buffers, sizeof(*st.buffers));
+	if (!st.buffers)
 	{
-		fprintf(stderr, "no longest transit?\n");
-		return 0;
+		fprintf(stderr, "stream: out of memory\n");
+		exit(-1);
 	}
 
-	fprintf(stderr, "Total transit: %.3f\n", initial_transit_len);
-	fprintf(stderr, "longest transit: %.3f: %.3f,%.3f\n",
-		max_transit,
-		transit_v->x1,
-		transit_v->y1
-	);
+	vector_profile.transit_in = NAN;
+	const double parse_start = monotime();
+	if (vectors_read(vector_file, vector_stream_sink, &st) < 0)
+		exit(-1);
+	vector_profile.parse = monotime() - parse_start;
+
+	// the top level tiles, sorted into serpentine order
+	const unsigned top = st.count;
+	unsigned * const order = calloc(top + 1, sizeof(*order));
+	for (unsigned i = 0 ; i < top ; i++)
+		order[i] = i;
+	vector_stream_sorting = &st;
+	qsort(order, top, sizeof(*order), vector_tile_cmp);
 
-	// then find the closest *end point* prior to this transit
-	vector_t * closest = NULL;
-	double min_dist = 1e9;
-	for(vector_t * v = vector ; v != transit_v ; v = v->next)
+	double sx = 0;
+	double sy = 0;
+
+	for (int pass = 0 ; pass < VECTOR_PASSES ; pass++)
 	{
-		double dx = v->x2 - transit_v->x1;
-		double dy = v->y2 - transit_v->y1;
-		double dist = dx*dx + dy*dy;
-		if (min_dist < dist)
+		vector_stream_out_t out = {
+			.pjl_file = pjl_file,
+			.sx = sx,
+			.sy = sy,
+			.chain = opts->chain,
+			.tolerance = opts->tolerance,
+			.binary = opts->binary,
+			.cost = opts->cost,
+		};
+		unsigned tiles = 0;
+
+		for (unsigned i = 0 ; i < top ; i++)
+		{
+			if (st.tiles[order[i]].pass != pass)
+				continue;
+
+			if (!tiles++)
+			{
+				fprintf(stderr, "Group %d\n", pass);
+				output_layer(pjl_file, pass, opts->binary);
+			}
+
+			vector_stream_tile(&st, order[i], (st.tiles[order[i]].ty & 1) ? -1 : 1, &out);
+		}
+
+		if (!tiles)
 			continue;
-		min_dist = dist;
-		closest = v;
+
+		fprintf(stderr, "Tiles: %u\n", tiles);
+		fprintf(stderr, "Sort: %.3f sec\n", out.sort_time);
+		vector_stats_print(&out.stats);
+		output_layer_end(pjl_file, opts->binary);
+		vector_profile.sort += out.sort_time;
+		vector_profile.optimise += out.sort_time;
+
+		sx = out.sx;
+		sy = out.sy;
 	}
 
-	if (!closest)
+	if (st.splits)
+		fprintf(stderr, "Split %u oversized tiles\n", st.splits);
+	if (st.flushes)
+		fprintf(stderr, "Spilled the tile buffers %u times\n", st.flushes);
+
+	free(order);
+	free(st.buffers);
+	free(st.tiles);
+	free(st.lookup.table);
+	fclose(st.spill);
+}
+
+
+/** Follow the merged passes to the one that they are plotted with. */
+static int
+vector_marker_find(
+	const int * const marker,
+	int pass
+)
+{
+	while (marker[pass] != pass)
+		pass = marker[pass];
+	return pass;
+}
+
+
+/** Merge the comma separated passes in list into the first one.
+ * Returns -1 if it is not a list of pass numbers.
+ */
+static int
+vector_same_marker(
+	int * const marker,
+	const char * list
+)
+{
+	int target = -1;
+	while (1)
 	{
-		fprintf(stderr, "could not find a close one?\n");
-		return 0;
+		char * end;
+		const long pass = strtol(list, &end, 10);
+		if (end == list || pass < 0 || pass >= VECTOR_PASSES)
+			return -1;
+
+		const int p = vector_marker_find(marker, pass);
+		if (target < 0)
+			target = p;
+		else
+			marker[p] = target;
+
+		if (*end == '\0')
+			break;
+		if (*end != ',')
+			return -1;
+		list = end + 1;
+	}
+
+	// flatten it so that the readers can look each pass up directly
+	for (int i = 0 ; i < VECTOR_PASSES ; i++)
+		marker[i] = vector_marker_find(marker, i);
+
+	return 0;
+}
+
+
+/** Multi-plotter splitting.
+ *
+ * Several plotters side by side on one wall can share a job, each in
+ * its own vertical strip.  The strips are chosen so that the plotters
+ * all finish at about the same time, rather than by area: a strip of
+ * dense hatching takes much longer than one of outlines.
+ *
+ * Each segment is weighed by its drawing time and the strips cut at
+ * the quantiles of the weight along x.  Every strip is then sorted,
+ * all of them in parallel, and its time estimated with the cost model
+ * as the drawing plus the pen up moves.  The ratio of the estimate to
+ * the drawing time says how much transit each strip really needs, so
+ * the weights are scaled by it and the strips cut again, for a few
+ * rounds until they balance.  The refinement only runs on the final
+ * strips.
+ *
+ * Each strip is moved to start at about x=0 and written to its own
+ * file, so that each plotter draws it from its own origin.
+ */
+#define VECTOR_SPLIT_ROUNDS 4
+#define VECTOR_SPLIT_BALANCE 0.02
+
+typedef struct
+{
+	double x;
+	double w;
+	unsigned pass;
+	unsigned i;
+} vector_split_seg_t;
+
+typedef struct
+{
+	vectors_t pass[VECTOR_PASSES];
+	const vector_opts_t * opts;
+	int refine;
+	double shift; // mm subtracted from x to give the plotter's own
+	double min_x;
+	double max_x;
+	double draw; // sec, the weights of the segments that it holds
+	double time; // sec, the estimate once it is sorted
+	vector_counts_t counts;
+} vector_region_t;
+
+
+static int
+vector_split_cmp(
+	const void * const a_ptr,
+	const void * const b_ptr
+)
+{
+	const vector_split_seg_t * const a = a_ptr;
+	const vector_split_seg_t * const b = b_ptr;
+	return a->x < b->x ? -1 : a->x > b->x;
+}
+
+
+/** Pen up cost in the model's unit, as seconds. */
+static double
+vector_split_secs(
+	const vector_cost_t * const cost,
+	const double transit
+)
+{
+	return strcmp(cost->unit, "sec") == 0
+		? transit
+		: transit * 60 / cost->transit_feed;
+}
+
+
+/** Estimated time for the strip, drawing and moving between the
+ * lines, in the order that it has been sorted into, from u,v in the
+ * sort space where the sort of its first pass started.
+ */
+static double
+vector_split_time(
+	const vector_cost_t * const cost,
+	const vector_region_t * const r,
+	double u,
+	double v
+)
+{
+	double total = 0;
+
+	for (int p = 0 ; p < VECTOR_PASSES ; p++)
+	{
+		const vectors_t * const vs = &r->pass[p];
+		if (!vs->count)
+			continue;
+
+		total += vector_split_secs(cost, vector_cost_total(cost, vs, u, v));
+		for (unsigned i = 0 ; i < vs->count ; i++)
+			total += dist(vs->x1[i], vs->y1[i], vs->x2[i], vs->y2[i])
+				* 60 / cost->feed;
+
+		vector_cost_map(cost, vs->x2[vs->count - 1], vs->y2[vs->count - 1], &u, &v);
 	}
 
-	// move the longest transit destination to come after the
-	// one closest to it, then re-sort based on that point
+	return total;
+}
 
-	// remove transit_v from the list
-	if (transit_v->next)
-		transit_v->next->prev = transit_v->prev;
-	if (transit_v->prev)
-		*transit_v->prev = transit_v->next;
 
-	// re-insert it after the closest one
-	transit_v->next = closest->next;
-	transit_v->prev = &closest->next;
-	closest->next = transit_v;
-	if (transit_v->next)
-		transit_v->next->prev = &transit_v->next;
+/** Sort the passes of one strip, each carrying on from the end of the
+ * one before like the sequential sort, and estimate its time.
+ */
+static void *
+vector_split_worker(
+	void * const arg
+)
+{
+	vector_region_t * const r = arg;
+	const vector_opts_t * const opts = r->opts;
+	const double start_x = 0, start_y = 0;
+	double lx = start_x, ly = start_y;
 
-	// now sort the ones that come after it
-	double cx2 = transit_v->x2;
-	double cy2 = transit_v->y2;
-	vector_optimize(&transit_v->next, &cx2, &cy2);
+	for (int p = 0 ; p < VECTOR_PASSES ; p++)
+	{
+		vectors_t * const vs = &r->pass[p];
+		if (!vs->count)
+			continue;
 
-	const double new_transit_len = vector_transit_len(vector);
-	fprintf(stderr, "Refine transit %.3f\n", new_transit_len);
+		const double sx = lx, sy = ly;
+		vector_chains_t ch = { .count = 0 };
+		vectors_t * const sorted = vector_sort_begin(vs,
+			opts->chain, opts->tolerance, opts->cost, &ch);
+		vector_optimize(sorted, 0, &lx, &ly, opts->cost, &r->counts);
+		if (r->refine)
+			vector_refine(sorted, sx, sy, opts->cost, &opts->refine);
+		vector_sort_end(vs, sorted, &ch);
 
-	*cx_ptr = cx2;
-	*cy_ptr = cy2;
+		vector_cost_map(opts->cost,
+			vs->x2[vs->count - 1], vs->y2[vs->count - 1],
+			&lx, &ly);
+	}
 
-	return initial_transit_len - new_transit_len;
+	r->time = vector_split_time(opts->machine, r, start_x, start_y);
+	return NULL;
 }
 
 
+/** Copy the segments into the strips between the cuts, shifting each
+ * one to start at x=0, and sort them all in parallel.
+ */
 static void
-output_vector(
-	FILE * const pjl_file,
-	const vector_t * v
+vector_split_sort(
+	const vector_job_t * const job,
+	const vector_split_seg_t * const segs,
+	const size_t count,
+	const double * const cuts,
+	vector_region_t * const regions,
+	const vector_opts_t * const opts,
+	const int refine
 )
 {
-	double lx = 0;
-	double ly = 0;
+	const int n = opts->split;
+
+	for (int k = 0 ; k < n ; k++)
+	{
+		vector_region_t * const r = &regions[k];
+		for (int p = 0 ; p < VECTOR_PASSES ; p++)
+			vectors_free(&r->pass[p]);
+		memset(r, 0, sizeof(*r));
+		r->opts = opts;
+		r->refine = refine;
+		r->min_x = INFINITY;
+		r->max_x = -INFINITY;
+	}
 
-	while (v)
+	// segs are in order of x, so each strip is a run of them; this
+	// finds its extent and how much of each pass it has
+	for (size_t j = 0, k = 0 ; j < count ; j++)
 	{
-		if (fpeq(v->x1,lx) && fpeq(v->y1,ly))
+		while (k + 1 < (size_t) n && segs[j].x >= cuts[k + 1])
+			k++;
+
+		vector_region_t * const r = &regions[k];
+		const vectors_t * const in = &job->pass[segs[j].pass];
+		const unsigned i = segs[j].i;
+		r->min_x = fmin(r->min_x, fmin(in->x1[i], in->x2[i]));
+		r->max_x = fmax(r->max_x, fmax(in->x1[i], in->x2[i]));
+		r->draw += segs[j].w;
+		r->pass[segs[j].pass].count++;
+	}
+
+	for (int k = 0 ; k < n ; k++)
+	{
+		vector_region_t * const r = &regions[k];
+		// a whole number of mm to place the plotter by, which also
+		// leaves the digits of the coordinates as they were
+		r->shift = isfinite(r->min_x) ? floor(r->min_x) : 0;
+		for (int p = 0 ; p < VECTOR_PASSES ; p++)
 		{
-			// This is the continuation of a line, so
-			// just add additional points
-			fprintf(pjl_file, "L %.3f %.3f\n",
-				v->x2,
-				v->y2
-			);
-		} else {
-			// Stop the laser; we need to transit
-			// and then start the laser as we go to
-			// the next point.  Note initial ";"
-			fprintf(pjl_file, "\nM %.3f %.3f\nL %.3f %.3f\n",
-				v->x1,
-				v->y1,
-				v->x2,
-				v->y2
-			);
+			vectors_t * const vs = &r->pass[p];
+			const unsigned size = vs->count;
+			vs->count = 0;
+			if (size)
+				vector_grow(vs, size);
 		}
+	}
 
-		// Changing power on the fly is not supported for now
-		// \todo: Check v->power and adjust ZS, XR, etc
+	// in the input order within each pass, so the sort is the same
+	// as it would be for the strip on its own
+	for (int p = 0 ; p < VECTOR_PASSES ; p++)
+	{
+		const vectors_t * const in = &job->pass[p];
+		for (unsigned i = 0, k = 0 ; i < in->count ; i++)
+		{
+			const double x = (in->x1[i] + in->x2[i]) / 2;
+			for (k = 0 ; k + 1 < (unsigned) n && x >= cuts[k + 1] ; k++)
+				;
 
-		// Move to the next vector, updating our current point
-		lx = v->x2;
-		ly = v->y2;
-		v = v->next;
+			vector_region_t * const r = &regions[k];
+			vectors_t * const vs = &r->pass[p];
+			const unsigned o = vs->count++;
+			vs->x1[o] = in->x1[i] - r->shift;
+			vs->y1[o] = in->y1[i];
+			vs->x2[o] = in->x2[i] - r->shift;
+			vs->y2[o] = in->y2[i];
+		}
+	}
+
+	// only the counts of the final round are reported
+	vector_profile.counts = (vector_counts_t){ 0 };
+
+	pthread_t * const tids = calloc(n + 1, sizeof(*tids));
+	for (int k = 0 ; k < n ; k++)
+	{
+		if (pthread_create(&tids[k], NULL, vector_split_worker, &regions[k]) != 0)
+		{
+			perror("pthread_create");
+			exit(-1);
+		}
+	}
+
+	for (int k = 0 ; k < n ; k++)
+	{
+		pthread_join(tids[k], NULL);
+		vector_profile.counts.reversals += regions[k].counts.reversals;
+		vector_profile.counts.visits += regions[k].counts.visits;
 	}
-	fprintf(pjl_file, "\n");
+
+	free(tids);
 }
 
-				
+
+/** Cut the segments, in order of x, into n runs of equal weight,
+ * with each weight scaled by the factor of the strip it is in now.
+ * Returns 0 if the cuts are the same as they were.
+ */
+static int
+vector_split_cuts(
+	const vector_split_seg_t * const segs,
+	const size_t count,
+	const int n,
+	const double * const factor,
+	double * const cuts
+)
+{
+	double total = 0;
+	for (size_t j = 0, k = 0 ; j < count ; j++)
+	{
+		while (k + 1 < (size_t) n && segs[j].x >= cuts[k + 1])
+			k++;
+		total += segs[j].w * factor[k];
+	}
+
+	double * const next = calloc(n + 1, sizeof(*next));
+	next[0] = -INFINITY;
+	next[n] = INFINITY;
+
+	double sum = 0;
+	int cut = 1;
+	for (size_t j = 0, k = 0 ; j < count && cut < n ; j++)
+	{
+		while (k + 1 < (size_t) n && segs[j].x >= cuts[k + 1])
+			k++;
+		sum += segs[j].w * factor[k];
+
+		// halfway to the next segment, so that it is not on the cut
+		while (cut < n && sum >= total * cut / n)
+			next[cut++] = j + 1 < count
+				? (segs[j].x + segs[j + 1].x) / 2
+				: segs[j].x + 1;
+	}
+
+	while (cut < n)
+		next[cut++] = INFINITY;
+
+	const int moved = memcmp(cuts, next, (n + 1) * sizeof(*cuts)) != 0;
+	memcpy(cuts, next, (n + 1) * sizeof(*cuts));
+	free(next);
+	return moved;
+}
+
+
 static void
-generate_vectors(
+generate_vectors_split(
 	FILE * const vector_file,
-	FILE * const pjl_file
+	const vector_opts_t * const opts
 )
 {
-	vectors_t * const vectors = vectors_parse(vector_file);
-	double lx = 0;
-	double ly = 0;
+	const int n = opts->split;
+	const vector_cost_t * const machine = opts->machine;
 
-	for (int i = 0 ; i < VECTOR_PASSES ; i++)
+	const double parse_start = monotime();
+	vector_job_t * const job = vectors_parse(vector_file, opts->marker);
+	if (!job)
+		exit(-1);
+	vector_profile.parse = monotime() - parse_start;
+	const double sort_start = monotime();
+
+	size_t count = 0;
+	for (int p = 0 ; p < VECTOR_PASSES ; p++)
+		count += job->pass[p].count;
+
+	// every segment weighs its drawing time, and a little more so
+	// that even a dot takes some time
+	vector_split_seg_t * const segs = calloc(count + 1, sizeof(*segs));
+	size_t j = 0;
+	for (int p = 0 ; p < VECTOR_PASSES ; p++)
 	{
-		vectors_t * const vs = &vectors[i];
-		if (!vs->vectors)
-			continue;
+		const vectors_t * const vs = &job->pass[p];
+		for (unsigned i = 0 ; i < vs->count ; i++)
+		{
+			const double len = dist(vs->x1[i], vs->y1[i], vs->x2[i], vs->y2[i]);
+			segs[j++] = (vector_split_seg_t){
+				.x = (vs->x1[i] + vs->x2[i]) / 2,
+				.w = (len + 0.01) * 60 / machine->feed,
+				.pass = p,
+				.i = i,
+			};
+		}
+	}
+	qsort(segs, count, sizeof(*segs), vector_split_cmp);
 
-		fprintf(stderr, "Group %d\n", i);
-		vector_stats(vs->vectors);
-		vector_optimize(
-			&vs->vectors,
-			&lx, &ly
-		);
+	double * const cuts = calloc(n + 1, sizeof(*cuts));
+	double * const factor = calloc(n + 1, sizeof(*factor));
+	double * const best = calloc(n + 1, sizeof(*best));
+	vector_region_t * const regions = calloc(n + 1, sizeof(*regions));
+	if (!segs || !cuts || !factor || !regions || !best)
+	{
+		fprintf(stderr, "split: out of memory\n");
+		exit(-1);
+	}
 
-		vector_stats(vs->vectors);
+	for (int k = 0 ; k < n ; k++)
+		factor[k] = 1;
+	cuts[0] = -INFINITY;
+	cuts[n] = INFINITY;
+	for (int k = 1 ; k < n ; k++)
+		cuts[k] = INFINITY;
+	vector_split_cuts(segs, count, n, factor, cuts);
 
-/*
-		for(int i = 0 ; i < 8 ; i++)
+	// the rounds do not always improve on the one before, so the
+	// cuts that gave the earliest finish are the ones that are kept
+	double best_time = INFINITY;
+	int best_round = 0;
+	int round;
+
+	for (round = 1 ; ; round++)
+	{
+		vector_split_sort(job, segs, count, cuts, regions, opts, 0);
+
+		double lo = INFINITY, hi = 0;
+		for (int k = 0 ; k < n ; k++)
 		{
-			double sx = vs->vectors->x1;
-			double sy = vs->vectors->y1;
-			if (vector_refine(vs->vectors, &sx, &sy) <= 0)
-				break;
-			lx = sx;
-			ly = sy;
+			lo = fmin(lo, regions[k].time);
+			hi = fmax(hi, regions[k].time);
 		}
-*/
 
+		fprintf(stderr, "Split round %d: %.0f to %.0f sec\n", round, lo, hi);
+		if (hi < best_time)
+		{
+			best_time = hi;
+			best_round = round;
+			memcpy(best, cuts, (n + 1) * sizeof(*best));
+		}
+
+		if (hi - lo <= hi * VECTOR_SPLIT_BALANCE || round == VECTOR_SPLIT_ROUNDS)
+			break;
+
+		for (int k = 0 ; k < n ; k++)
+			factor[k] = regions[k].draw > 0
+				? regions[k].time / regions[k].draw
+				: 1;
 
-		fprintf(pjl_file, "P %d %d %d\n",
-			i == 0 ? 100 : 0,
-			i == 1 ? 100 : 0,
-			i == 2 ? 100 : 0
-		);
-		output_vector(pjl_file, vs->vectors);
-		fprintf(pjl_file, "\n\n");
+		// too few segments for the cuts to move any more
+		if (!vector_split_cuts(segs, count, n, factor, cuts))
+			break;
+	}
+
+	const int refine = opts->refine.time > 0 || opts->refine.sweeps > 0;
+	if (refine || best_round != round)
+		vector_split_sort(job, segs, count, best, regions, opts, refine);
+
+	vector_profile.sort = monotime() - sort_start;
+
+	for (int k = 0 ; k < n ; k++)
+	{
+		vector_region_t * const r = &regions[k];
+
+		char path[4096];
+		snprintf(path, sizeof(path), opts->split_output, k);
+		FILE * const f = fopen(path, "w");
+		if (!f)
+		{
+			perror(path);
+			exit(-1);
+		}
+
+		unsigned segments = 0;
+		memset(&vector_out_bin, 0, sizeof(vector_out_bin));
+		vector_profile.x = vector_profile.y = 0;
+
+		for (int p = 0 ; p < VECTOR_PASSES ; p++)
+		{
+			const vectors_t * const vs = &r->pass[p];
+			if (!vs->count)
+				continue;
+
+			segments += vs->count;
+			output_layer(f, p, opts->binary);
+			double ox = 0, oy = 0;
+			output_vector(f, vs, &ox, &oy, opts->binary);
+			output_layer_end(f, opts->binary);
+		}
+
+		// a binary file with nothing in it still needs its header
+		if (opts->binary && !vector_out_bin.header)
+			vecbin_write_header(f);
+
+		if (fclose(f) != 0)
+		{
+			perror(path);
+			exit(-1);
+		}
+
+		fprintf(stderr, "Part %d: %s, %u segments, x %.1f to %.1f mm moved by %+.0f, about %.0f sec\n",
+			k, path, segments,
+			segments ? r->min_x : 0, segments ? r->max_x : 0,
+			0 - r->shift, r->time);
+
+		for (int p = 0 ; p < VECTOR_PASSES ; p++)
+			vectors_free(&r->pass[p]);
+	}
+
+	free(regions);
+	free(best);
+	free(factor);
+	free(cuts);
+	free(segs);
+	vector_job_free(job);
+}
+
+
+/** Where the time went, and how good the result is, either as a line
+ * for people or as a single line of JSON for a job runner to collect.
+ */
+static void
+vector_profile_print(
+	const int json
+)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+
+	if (json)
+	{
+		char transit_in[32] = "null";
+		if (!isnan(vector_profile.transit_in))
+			snprintf(transit_in, sizeof(transit_in), "%.3f", vector_profile.transit_in);
+
+		fprintf(stderr, "{"
+			"\"parse\":%.6f,\"dedup\":%.6f,\"sort\":%.6f,"
+			"\"optimise\":%.6f,\"refine\":%.6f,\"emit\":%.6f,"
+			"\"segments\":%llu,\"duplicates\":%llu,"
+			"\"reversals\":%llu,\"cells_visited\":%llu,"
+			"\"two_opt\":%llu,\"or_opt\":%llu,"
+			"\"transit_in\":%s,\"transit\":%.3f,\"peak_kb\":%ld}\n",
+			vector_profile.parse,
+			vector_profile.dedup,
+			vector_profile.sort,
+			vector_profile.optimise,
+			vector_profile.refine,
+			vector_profile.emit,
+			vector_profile.segments,
+			vector_profile.dups,
+			vector_profile.counts.reversals,
+			vector_profile.counts.visits,
+			vector_profile.two_opt,
+			vector_profile.or_opt,
+			transit_in,
+			vector_profile.transit,
+			ru.ru_maxrss);
+		return;
 	}
+
+	fprintf(stderr, "Total: parse %.3f sort %.3f emit %.3f sec, %llu duplicates, transit %.0f mm, peak %ld MB\n",
+		vector_profile.parse,
+		vector_profile.sort,
+		vector_profile.emit,
+		vector_profile.dups,
+		vector_profile.transit,
+		ru.ru_maxrss / 1024);
 }
 
 
-int main(void)
+static const char usage[] =
+"Usage: vecsort [options] < vectors > sorted\n"
+"Options:\n"
+"    -s | --stream     Sort in spatial tiles spilled to a temp file, greedy\n"
+"                      only: not with the refinement or --balanced/--best\n"
+"    -t | --tile N     Initial tile size in mm for --stream (default 500)\n"
+"    -m | --memory N   Memory budget in MB for --stream (default 256)\n"
+"    -c | --chain      Join segments into polylines before sorting\n"
+"    --tolerance N     Simplify the polylines to within N mm (implies -c)\n"
+"    -b | --binary     Write the sorted vectors in the binary format\n"
+"    -j | --jobs N     Sort the passes and large tiles with N threads\n"
+"    -r | --refine N   Improve the sort with 2-opt/Or-opt for up to N sec\n"
+"    --refine-sweeps N Limit the refinement to N sweeps (deterministic)\n"
+"    --fast            Greedy sort only (the default)\n"
+"    --balanced        Chain, then refine with 2-opt for up to 10 sec\n"
+"    --best            Chain, then refine with 2-opt and Or-opt for up to\n"
+"                      60 sec; ^C stops it and writes the best order so far\n"
+"    --cost MODEL      Minimise the pen up 'distance' (default) or 'time'\n"
+"    --cache DIR       Reuse the sorted passes that have not changed\n"
+"    --schedule        Choose the order of the passes, and without -j sort\n"
+"                      them again in it, for the least travel between them\n"
+"    --same-marker a,b Plot pass b with the marker of pass a, as one pass\n"
+"    --stats=json      Write the stage times and counters as a JSON line\n"
+"    --split N         Share the plot between N plotters side by side, each\n"
+"                      taking a strip that should take about as long\n"
+"    --split-output F  File for each strip, with a %d for its number\n"
+"    --feed N          Drawing rate for the --split estimates in mm/min\n"
+"                      (default 2000)\n"
+"Machine geometry for --cost time, as for pjl2gcode:\n"
+"    --width N         Separation between the pulleys in mm\n"
+"    --length N        Length of the two strings at the home position in mm\n"
+"    --offset x,y      Position of the plot origin on the wall in mm\n"
+"    --transit N       Transit rate for the motors in mm/min\n"
+"    --accel N         Acceleration in mm/s/s\n"
+"    -h | --help       This help\n"
+;
+
+
+int main(int argc, char ** argv)
 {
-	generate_vectors(stdin, stdout);
+	int stream = 0;
+	int preset = 0; // --fast, --balanced or --best
+	int stats_json = 0;
+	double tile_size = 500;
+	double memory_mb = 256;
+	vector_opts_t opts = {
+		.threads = 1,
+		.marker = { 0, 1, 2 },
+	};
+
+	const char * cost_name = NULL;
+	vector_cost_t machine = {
+		.polar = {
+			.width = 2501.9,
+			.home_length = 2032.0,
+			.steps_per_mm = 1,
+		},
+		.planner = {
+			.acceleration = 1000,
+			.junction_deviation = 0.01,
+			.max_rate = { 30000 / 60.0, 30000 / 60.0 },
+		},
+		.transit_feed = 2500,
+		.feed = 2000,
+	};
+
+	static const struct option long_options[] = {
+		{ "stream",	no_argument,		NULL, 's' },
+		{ "tile",	required_argument,	NULL, 't' },
+		{ "memory",	required_argument,	NULL, 'm' },
+		{ "chain",	no_argument,		NULL, 'c' },
+		{ "binary",	no_argument,		NULL, 'b' },
+		{ "jobs",	required_argument,	NULL, 'j' },
+		{ "refine",	required_argument,	NULL, 'r' },
+		{ "refine-sweeps", required_argument,	NULL, 'R' },
+		{ "fast",	no_argument,		NULL, '0' },
+		{ "balanced",	no_argument,		NULL, '1' },
+		{ "best",	no_argument,		NULL, '2' },
+		{ "cost",	required_argument,	NULL, 'C' },
+		{ "cache",	required_argument,	NULL, 'K' },
+		{ "schedule",	no_argument,		NULL, 'S' },
+		{ "same-marker", required_argument,	NULL, 'M' },
+		{ "stats",	required_argument,	NULL, 'T' },
+		{ "tolerance",	required_argument,	NULL, 'E' },
+		{ "split",	required_argument,	NULL, 'P' },
+		{ "split-output", required_argument,	NULL, 'o' },
+		{ "feed",	required_argument,	NULL, 'D' },
+		{ "width",	required_argument,	NULL, 'W' },
+		{ "length",	required_argument,	NULL, 'L' },
+		{ "offset",	required_argument,	NULL, 'O' },
+		{ "transit",	required_argument,	NULL, 'F' },
+		{ "accel",	required_argument,	NULL, 'A' },
+		{ "help",	no_argument,		NULL, 'h' },
+		{ NULL, 0, NULL, 0 },
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "st:m:cbj:r:h?", long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+		case 's': stream = 1; break;
+		case 't': tile_size = atof(optarg); break;
+		case 'm': memory_mb = atof(optarg); break;
+		case 'c': opts.chain = 1; break;
+		case 'b': opts.binary = 1; break;
+		case 'j': opts.threads = atoi(optarg); break;
+		case 'r': opts.refine.time = atof(optarg); break;
+		case 'R': opts.refine.sweeps = atoi(optarg); break;
+		case '0': case '1': case '2': preset = opt - '0'; break;
+		case 'C': cost_name = optarg; break;
+		case 'K': opts.cache = optarg; break;
+		case 'S': opts.schedule = 1; break;
+		case 'E': opts.tolerance = atof(optarg); break;
+		case 'P': opts.split = atoi(optarg); break;
+		case 'o': opts.split_output = optarg; break;
+		case 'D': machine.feed = atof(optarg); break;
+		case 'T':
+			if (strcmp(optarg, "json") == 0)
+				stats_json = 1;
+			else
+			if (strcmp(optarg, "text") != 0)
+			{
+				fprintf(stderr, "%s", usage);
+				return -1;
+			}
+			break;
+		case 'M':
+			if (vector_same_marker(opts.marker, optarg) < 0)
+			{
+				fprintf(stderr, "%s", usage);
+				return -1;
+			}
+			break;
+		case 'W': machine.polar.width = atof(optarg); break;
+		case 'L': machine.polar.home_length = atof(optarg); break;
+		case 'O':
+			if (sscanf(optarg, "%lf,%lf", &machine.offset_x, &machine.offset_y) != 2)
+			{
+				fprintf(stderr, "%s", usage);
+				return -1;
+			}
+			break;
+		case 'F': machine.transit_feed = atof(optarg); break;
+		case 'A': machine.planner.acceleration = atof(optarg); break;
+		case 'h': printf("%s", usage); return 0;
+		default: fprintf(stderr, "%s", usage); return -1;
+		}
+	}
+
+	if (stream && opts.schedule)
+	{
+		fprintf(stderr, "--schedule needs all of the passes, not --stream\n");
+		return -1;
+	}
+
+	// the tiles are only sorted greedily, as they are streamed out
+	if (stream && (preset > 0 || opts.refine.time > 0 || opts.refine.sweeps > 0))
+	{
+		fprintf(stderr, "--stream does not refine, so not with --refine, --refine-sweeps, --balanced or --best\n");
+		return -1;
+	}
+
+	if (tile_size <= 0 || memory_mb <= 0 || opts.threads < 1 || opts.tolerance < 0
+	||  machine.transit_feed <= 0 || machine.planner.acceleration <= 0
+	||  machine.feed <= 0 || opts.split < 0)
+	{
+		fprintf(stderr, "%s", usage);
+		return -1;
+	}
+
+	if (opts.split && (stream || opts.schedule || opts.cache))
+	{
+		fprintf(stderr, "--split sorts the strips on their own, not with --stream, --schedule or --cache\n");
+		return -1;
+	}
+
+	// exactly one %d, so that each strip has a file of its own
+	if (opts.split)
+	{
+		const char * const fmt = opts.split_output;
+		const char * const d = fmt ? strstr(fmt, "%d") : NULL;
+		if (!d || strchr(fmt, '%') != d || strchr(d + 2, '%'))
+		{
+			fprintf(stderr, "--split needs --split-output with a %%d in it\n");
+			return -1;
+		}
+	}
+
+	if (cost_name)
+	{
+		const vector_cost_t * const model = vector_cost_find(cost_name);
+		if (!model)
+		{
+			fprintf(stderr, "Unknown cost model '%s'\n", cost_name);
+			return -1;
+		}
+
+		if (polar_init(&machine.polar) < 0)
+		{
+			fprintf(stderr, "Width %g is too wide for length %g!\n",
+				machine.polar.width, machine.polar.home_length);
+			return -1;
+		}
+
+		machine.name = model->name;
+		machine.unit = model->unit;
+		machine.map = model->map;
+		machine.transit = model->transit;
+		machine.bound = model->bound;
+		opts.cost = &machine;
+	} else {
+		// the split estimates still need a pen up model
+		const vector_cost_t * const model = vector_cost_find("distance");
+		machine.name = model->name;
+		machine.unit = model->unit;
+		machine.transit = model->transit;
+		machine.bound = model->bound;
+	}
+
+	opts.machine = &machine;
+
+	// the presets only fill in the refinement budget if it was not given
+	if (preset > 0)
+	{
+		opts.chain = 1;
+		opts.refine.two_opt_only = preset == 1;
+		if (!opts.refine.time && !opts.refine.sweeps)
+			opts.refine.time = preset == 1 ? 10 : 60;
+	}
+
+	// simplifying works along the chains
+	if (opts.tolerance > 0)
+		opts.chain = 1;
+
+	if (!stream && (opts.refine.time > 0 || opts.refine.sweeps > 0))
+		signal(SIGINT, vector_interrupt);
+
+	vector_scan_select();
+	vector_profile.timed = stats_json;
+
+	if (stream)
+		generate_vectors_stream(stdin, stdout, tile_size, memory_mb, &opts);
+	else
+	if (opts.split)
+		generate_vectors_split(stdin, &opts);
+	else
+		generate_vectors(stdin, stdout, &opts);
+
+	vector_profile_print(stats_json);
 	return 0;
 }